@@ -4,6 +4,69 @@
 #include <map>
 #include <set>
 #include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <concepts>
+#include <atomic>
+#include <array>
+#include <mutex>
+#include <shared_mutex>
+#include <cstdint>
+#include <cctype>
+#include <iterator>
+#include <list>
+#include <ranges>
+#include <numeric>
+#include <chrono>
+#include <bit>
+#include <fstream>
+#include <istream>
+#include <cstdio>
+#include <unordered_map>
+#include <tuple>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <utility>
+#include <filesystem>
+
+// College files are mapped into memory, and they (and logs of changes) are
+// synced to disk, where it is possible. Elsewhere files are only flushed.
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define COLLEGE_HAS_MMAP 1
+#define COLLEGE_HAS_FSYNC 1
+#else
+#define COLLEGE_HAS_MMAP 0
+#define COLLEGE_HAS_FSYNC 0
+#endif
+
+// Literal parts of patterns are searched with vector instructions where they
+// are available (AVX2 only if compiler is allowed to use it). Width can be
+// forced by defining COLLEGE_SIMD_WIDTH (0 - no vectors, 16 or 32).
+#ifndef COLLEGE_SIMD_WIDTH
+#if defined(__AVX2__)
+#define COLLEGE_SIMD_WIDTH 32
+#elif defined(__SSE2__) || defined(_M_X64)
+#define COLLEGE_SIMD_WIDTH 16
+#else
+#define COLLEGE_SIMD_WIDTH 0
+#endif
+#endif
+
+#if COLLEGE_SIMD_WIDTH == 32
+#include <immintrin.h>
+#elif COLLEGE_SIMD_WIDTH == 16
+#include <emmintrin.h>
+#endif
 
 class Course
 {
@@ -11,6 +74,8 @@ public:
     Course() = delete;
     Course(const std::string &name, bool is_active = true) : course_name(name),
                                                       active(is_active) {}
+    Course(const Course &other) : course_name(other.course_name),
+                                  active(other.is_active()) {}
 
     const std::string &get_name() const noexcept
     {
@@ -19,17 +84,25 @@ public:
 
     bool is_active() const noexcept
     {
-        return active;
+        return active.load(std::memory_order_relaxed);
     }
 
+    friend class College;
+
+private:
+    // Only College changes activeness (see College::change_course_activeness),
+    // so its counters of active courses see every change.
     void change_activeness(bool new_val) noexcept
     {
-        active = new_val;
+        active.store(new_val, std::memory_order_relaxed);
     }
 
-private:
     std::string course_name;
-    bool active;
+    // Atomic, since activeness can be changed while other threads query
+    // the same course.
+    std::atomic<bool> active;
+    // Given by College when course is added (see College::course_id).
+    std::uint32_t id = 0;
 };
 
 class Person
@@ -51,6 +124,8 @@ public:
         return surname;
     }
 
+    friend class College;
+
 protected:
     // using course_const_sp = std::shared_ptr<Course>;
 
@@ -70,19 +145,15 @@ protected:
         }
     };
 
-    struct my_cmp
-    {
-        bool operator()(const std::shared_ptr<Course> &a,
-                        const std::shared_ptr<Course> &b) const
-        {
-            return a->get_name() < b->get_name();
-        }
-    };
-
+    // Comparator is transparent, so sets of const courses can be searched
+    // with shared_ptr<Course> without making temporary shared_ptr copy.
     struct my_cmp_const
     {
-        bool operator()(const std::shared_ptr<const Course> &a,
-                        const std::shared_ptr<const Course> &b) const
+        using is_transparent = void;
+
+        template <typename A, typename B>
+        bool operator()(const std::shared_ptr<A> &a,
+                        const std::shared_ptr<B> &b) const
         {
             return a->get_name() < b->get_name();
         }
@@ -91,6 +162,8 @@ protected:
 private:
     std::string name;
     std::string surname;
+    // Given by College when person is added (see College::person_id).
+    std::uint32_t id = 0;
 };
 
 class Student : public virtual Person
@@ -100,26 +173,40 @@ public:
 
     Student(const std::string &name, const std::string &surname, 
         bool is_active = true) : Person(name, surname), active(is_active) {}
+    // Set of courses is allocated from given memory resource.
+    Student(const std::string &name, const std::string &surname,
+        bool is_active, std::pmr::memory_resource *resource) :
+        Person(name, surname), subjects_I_attend(resource),
+        active(is_active) {}
+
+    Student(const Student &other) : Person(other),
+        subjects_I_attend(other.subjects_I_attend), active(other.is_active()) {}
 
     virtual ~Student() = default;
 
     bool is_active() const noexcept
     {
-        return active;
+        return active.load(std::memory_order_relaxed);
     }
 
+    // Returned set is modified by College::assign_course, so it shouldn't be
+    // read while other thread assigns courses to the same student - such
+    // readers take its copy from College::get_courses instead.
     const auto &get_courses() const noexcept
     {
-        return subjects_I_attend_const;
+        return subjects_I_attend;
     }
 
     friend class College;
 
 protected:
-    std::set<std::shared_ptr<const Course>, my_cmp_const> 
-        subjects_I_attend_const;
-    std::set<std::shared_ptr<Course>, my_cmp> subjects_I_attend;
-    bool active;
+    // Only College modifies this set and it never needs to modify courses
+    // through it, so one set of const courses serves both College and
+    // get_courses().
+    std::pmr::set<std::shared_ptr<const Course>, my_cmp_const>
+        subjects_I_attend;
+    // Atomic for the same reason as Course::active.
+    std::atomic<bool> active;
 };
 
 class Teacher : public virtual Person
@@ -129,12 +216,17 @@ public:
 
     Teacher(const std::string &name, const std::string &surname) : 
         Person(name, surname) {}
+    // See Student(name, surname, is_active, resource).
+    Teacher(const std::string &name, const std::string &surname,
+        std::pmr::memory_resource *resource) :
+        Person(name, surname), subjects_I_handle(resource) {}
 
     virtual ~Teacher() = default;
 
+    // See Student::get_courses().
     const auto &get_courses() const
     {
-        return subjects_I_handle_const;
+        return subjects_I_handle;
     }
 
     friend class College;
@@ -142,9 +234,9 @@ public:
     friend class College;
 
 protected:
-    std::set<std::shared_ptr<const Course>, my_cmp_const> 
-        subjects_I_handle_const;
-    std::set<std::shared_ptr<Course>, my_cmp> subjects_I_handle;
+    // See Student::subjects_I_attend.
+    std::pmr::set<std::shared_ptr<const Course>, my_cmp_const>
+        subjects_I_handle;
 };
 
 class PhDStudent : public Student, public Teacher
@@ -156,6 +248,11 @@ public:
                bool is_active = true) : Person(name, surname),
                                         Student(name, surname, is_active),
                                         Teacher(name, surname) {}
+    // See Student(name, surname, is_active, resource).
+    PhDStudent(const std::string &name, const std::string &surname,
+               bool is_active, std::pmr::memory_resource *resource) :
+        Person(name, surname), Student(name, surname, is_active, resource),
+        Teacher(name, surname, resource) {}
     virtual ~PhDStudent() = default;
     friend class College;
 };
@@ -195,487 +292,6936 @@ bool constexpr is_student_teacher<Teacher>() { return true; }
 template <typename T>
 concept StudentTeacher = is_student_teacher<T>();
 
-class College
+/**
+ * Pointer to value shared by copies of pointer until one of them changes it
+ * - that one gets its own copy first (copy on write). Value and its copies
+ * are allocated in memory resource given when value is made. Unlike
+ * shared_ptr::use_count, unique() synchronizes with other owners releasing
+ * value, so value found unique can be changed in place right away.
+ */
+template <typename T>
+class CowPtr
 {
 public:
-    College() = default;
+    CowPtr() noexcept = default;
 
-    /**
-     * Function checks if course of given name is present in our college
-     * (names of courses are unique), and if not it creates such 
-     * course and adds it to set of courses and returns true.
-     */
-    bool add_course(const std::string &name, bool active = true)
+    template <typename... Args>
+    static CowPtr make(std::pmr::memory_resource *resource, Args &&...args)
     {
-        if (course_names.find(name) == course_names.end())
+        std::pmr::polymorphic_allocator<node> allocator(resource);
+        node *made = allocator.allocate(1);
+        try
         {
-            auto iter_to_inserted_course = course_set.emplace(
-                std::make_shared<Course>(name, active)).first;
-
-            course_names.emplace(name, iter_to_inserted_course);
-
-            return true;
+            ::new (made) node(resource, std::forward<Args>(args)...);
         }
-        return false;
+        catch (...)
+        {
+            allocator.deallocate(made, 1);
+            throw;
+        }
+        return CowPtr(made);
     }
 
-    /**
-     * Function returns set of shared_ptrs to courses which names satisfy given
-     * pattern. Courses in set are in lexycographic order by their names.
-     * Function does not modify anything in our college.
-     */
-    auto find_courses(const std::string &pattern) const
+    CowPtr(const CowPtr &other) noexcept : shared(other.shared)
     {
-        // We need custom comparator for our set, since we want our courses
-        // in lexycographic order given by their names.
-        auto my_cmp = [](const std::shared_ptr<Course> &a, const std::shared_ptr<Course> &b)
-        {
-            return a->get_name() < b->get_name();
-        };
+        if (shared != nullptr)
+            shared->owners.fetch_add(1, std::memory_order_relaxed);
+    }
 
-        // We need to make a new set, cause we can get many different patterns
-        // so each time we have to make new set of found elems and return it.
-        std::set<std::shared_ptr<Course>, decltype(my_cmp)> matching_courses;
+    CowPtr(CowPtr &&other) noexcept :
+        shared(std::exchange(other.shared, nullptr)) {}
+
+    CowPtr &operator=(CowPtr other) noexcept
+    {
+        std::swap(shared, other.shared);
+        return *this;
+    }
 
-        // course_names = map<course name, iterator to course in course_set>
-        for (auto iter = course_names.begin(); iter != course_names.end();
-             iter++)
+    ~CowPtr()
+    {
+        if (shared != nullptr &&
+            shared->owners.fetch_sub(1, std::memory_order_acq_rel) == 1)
         {
-            if (satisfies_pattern(iter->first, pattern))
-                matching_courses.emplace(*(iter->second));
+            std::pmr::polymorphic_allocator<node> allocator(shared->resource);
+            shared->~node();
+            allocator.deallocate(shared, 1);
         }
-
-        return matching_courses;
     }
 
-    bool change_course_activeness(const std::shared_ptr<Course> &course,
-                                  bool active) noexcept
+    explicit operator bool() const noexcept
     {
-        auto iter = course_set.find(course);
-
-        if (iter == course_set.end())
-            return false;
+        return shared != nullptr;
+    }
 
-        (*iter)->change_activeness(active);
+    const T &operator*() const noexcept
+    {
+        return shared->value;
+    }
 
-        return true;
+    const T *operator->() const noexcept
+    {
+        return &shared->value;
     }
 
-    /**
-     * Function removes given course from our college. Course is found by
-     * comparing shared ptrs, not courses' names, since we can have two courses
-     * with the same name, but in different colleges, so looking for course
-     * using its name would be a mistake.
-     */
-    bool remove_course(const std::shared_ptr<Course> &course) noexcept
+    bool unique() const noexcept
     {
-        // Erase with iterator throws nothing, find() also throws nothing.
-        auto iter = course_set.find(course);
+        return shared->owners.load(std::memory_order_acquire) == 1;
+    }
 
-        if (iter == course_set.end())
-            return false;
+    // Function returns value that can be changed in place, copying it first
+    // if it is shared.
+    T &unshared()
+    {
+        if (!unique())
+            *this = make(shared->resource, std::as_const(shared->value));
+        return shared->value;
+    }
 
-        // Firstly we remove name of our course from set of courses names.
-        // We need iterator so that it is noexcept.
-        // We need iterator so that it is noexcept.
-        auto iter_str = course_names.find((*iter)->get_name());
-        course_names.erase(iter_str);
+private:
+    struct node
+    {
+        template <typename... Args>
+        explicit node(std::pmr::memory_resource *_resource, Args &&...args) :
+            resource(_resource), value(make_value(std::forward<Args>(args)...))
+        {}
 
-        // We change activeness and remove whole course from courses set.
-        (*iter)->change_activeness(false);
-        course_set.erase(iter);
+        // Copies of values which use memory resources stay in resource of
+        // original.
+        T make_value(const T &other)
+        {
+            if constexpr (std::is_constructible_v<T, const T &,
+                              std::pmr::memory_resource *>)
+                return T(other, resource);
+            else
+                return T(other);
+        }
 
-        return true;
-    }
+        template <typename... Args>
+        T make_value(Args &&...args)
+        {
+            return T(std::forward<Args>(args)...);
+        }
 
-    /**
-     * Function add new person to college if person of given name and surname
-     * isn't alread present in it. We need specializations since some
-     * constructors need active parameter while others don't.
-     */
-    template <typename T>
-    bool add_person(const std::string &name, const std::string &surname, bool active = true);
+        std::atomic<std::size_t> owners = 1;
+        std::pmr::memory_resource *resource;
+        T value;
+    };
 
-    /**
-     * Function finds given student by comparing shared pointers in college 
-     * set, since we can have students of same names but in different colleges.
-     * Function is noexcept because even if dynamic_ptr_cast fails, target type
-     * is not reference type, so there will be no exception thrown, only
-     * nullptr returned.
-     */
-    bool change_student_activeness(const std::shared_ptr<Student> &student,
-                                   bool active) noexcept
-    {
-        auto iter = person_set.find(student);
+    explicit CowPtr(node *made) noexcept : shared(made) {}
 
-        if (iter == person_set.end())
-            return false;
+    node *shared = nullptr;
+};
 
-        std::dynamic_pointer_cast<Student>(*iter)->active = active;
+/**
+ * Set of values sorted by Compare and kept in chunks of at most chunk_size
+ * values. Copy of set shares chunks with original and a change copies only
+ * chunks it touches (and directory of chunks - one pointer per chunk - the
+ * first time after set was copied), so keeping old versions of set costs
+ * O(size / chunk_size + chunk_size) per change instead of O(size). Compare
+ * can also order values against keys they are looked up by. Every change
+ * invalidates iterators.
+ */
+template <typename Value, typename Compare = std::less<>,
+          std::size_t chunk_size = 256>
+class ChunkedSet
+{
+    using chunk = std::pmr::vector<Value>;
 
-        return true;
-    }
+public:
+    using value_type = Value;
+    using size_type = std::size_t;
 
-    /**
-     * Function finds people in college that name and surname have given
-     * patterns and these people are of type T. We use concept IsAcademic here
-     * since we need to ensure that type T has get_surname and get_name methods
-     * in order not to make many similar outside of class specializations.
-     */
-    template <IsAcademic T>
-    auto find(const std::string &name_pattern,
-              const std::string &surname_pattern) const
+    class const_iterator
     {
-        // Custom lexicographical comparator for our result set. Sorted by
-        // surname then name.
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = Value;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Value *;
+        using reference = const Value &;
+
+        const_iterator() noexcept = default;
 
-        auto name_cmp = [](const std::shared_ptr<T> &a,
-             const std::shared_ptr<T> &b)
+        reference operator*() const noexcept
         {
-            if (a->get_surname() != b->get_surname())
-                return a->get_surname() < b->get_surname();
-            else
-                return a->get_name() < b->get_name();
-        };
+            return *pos;
+        }
 
-        // Result set.
-        std::set<std::shared_ptr<T>, decltype(name_cmp)> matching_people;
+        pointer operator->() const noexcept
+        {
+            return pos;
+        }
 
-        for (auto iter = person_set.begin(); iter != person_set.end();
-             ++iter)
+        const_iterator &operator++() noexcept
         {
-            if (satisfies_pattern((*iter)->get_name(), name_pattern) &&
-                satisfies_pattern((*iter)->get_surname(), surname_pattern))
+            if (++pos == (*dir)->data() + (*dir)->size())
             {
-                auto found_person = std::dynamic_pointer_cast<T>(*iter);
-                // We need to check if cast was successful meaning != nullptr,
-                // cause we cannot cast i.e. teacher to student. If it was
-                // successful it means that *iter type matches type T.
-                if (found_person != nullptr)
-                    matching_people.emplace(found_person);
+                ++dir;
+                pos = dir == dir_end ? nullptr : (*dir)->data();
             }
+            return *this;
         }
 
-        return matching_people;
-    }
-
-    template <typename T>
-    auto find(const std::shared_ptr<Course>& course);
+        const_iterator operator++(int) noexcept
+        {
+            const_iterator old = *this;
+            ++*this;
+            return old;
+        }
 
-    /**
-    * Functions assigns the given course to the given person, as long as both
-    * the person and course are active (person must be active if 
-    * it is a student), and both course and person exist in this 
-    * college object. StudentTeacher concept ensures that this function
-    * will only accept students or teachers (or classes derived from them).
-    */
-    template <StudentTeacher T>
-    bool assign_course(const std::shared_ptr<T> &person,
-                       const std::shared_ptr<Course> &course)
-    {
-        if (!person_set.contains(person))
-            throw non_existing_person_exception();
-        else if (!course_set.contains(course))
-            throw non_existing_course_exception();
-        if (!course->is_active())
-            throw inactive_course_exception();
-        Student *temp_student = dynamic_cast<Student *>(person.get());
-        Teacher *temp_teacher = dynamic_cast<Teacher *>(person.get());
-        if (temp_student != nullptr)
+        const_iterator &operator--() noexcept
         {
-            if (!temp_student->is_active())
-                throw inactive_student_exception();
-            if (temp_student->subjects_I_attend.contains(course))
-                return false;
-            else
+            if (dir == dir_end || pos == (*dir)->data())
             {
-                temp_student->subjects_I_attend.emplace(course);
-                temp_student->subjects_I_attend_const.emplace(
-                    std::make_shared<const Course>(course));
-                return true;
+                --dir;
+                pos = (*dir)->data() + (*dir)->size();
             }
+            --pos;
+            return *this;
         }
-        else if (temp_teacher != nullptr)
+
+        const_iterator operator--(int) noexcept
         {
-            if (temp_teacher->subjects_I_handle.contains(course))
-                return false;
-            else
-            {
-                temp_teacher->subjects_I_handle.emplace(course);
-                temp_teacher->subjects_I_handle_const.emplace(
-                    std::make_shared<const Course>(course));
-                return true;
-            }
+            const_iterator old = *this;
+            --*this;
+            return old;
         }
-        return false;
-    }
 
-private:
-    // Person - identified by name and surname (they are unique)
-    std::set<std::shared_ptr<Person>> person_set;
+        bool operator==(const const_iterator &other) const noexcept
+        {
+            return dir == other.dir && pos == other.pos;
+        }
 
-    // Set of names and surnames to quickly checking if person is in college.
+    private:
+        friend class ChunkedSet;
 
-    // Set of names and surnames to quickly checking if person is in college.
-    std::set<std::pair<std::string, std::string>> people_names;
+        const_iterator(const CowPtr<chunk> *_dir, const CowPtr<chunk> *_end,
+                       const Value *_pos) noexcept :
+            dir(_dir), dir_end(_end), pos(_pos) {}
 
-    // Course - identified by its name (name is unique)
-    std::set<std::shared_ptr<Course>> course_set;
+        const CowPtr<chunk> *dir = nullptr;
+        const CowPtr<chunk> *dir_end = nullptr;
+        const Value *pos = nullptr;
+    };
 
-    // Map needed to quickly find course by its name and change sth in it.
+    using iterator = const_iterator;
 
-    // Map needed to quickly find course by its name and change sth in it.
-    std::map<std::string, std::set<std::shared_ptr<Course>>::iterator>
-        course_names;
+    explicit ChunkedSet(std::pmr::memory_resource *resource =
+                            std::pmr::get_default_resource()) :
+        chunks(resource) {}
 
-    // Exceptions for differents cases. Naming is self-explanatory.
-    class inactive_student_exception : public std::exception
+    // Copy shares chunks and stays in memory resource of original.
+    ChunkedSet(const ChunkedSet &other) :
+        chunks(other.chunks, other.chunks.get_allocator()),
+        count(other.count) {}
+
+    ChunkedSet(ChunkedSet &&other) noexcept :
+        chunks(std::move(other.chunks)), count(std::exchange(other.count, 0))
+    {}
+
+    ChunkedSet &operator=(const ChunkedSet &other)
     {
-        virtual const char* what() const throw()
-        {
-            return "Incorrect operation for an inactive student.";
-        }
-    };
+        chunks = other.chunks;
+        count = other.count;
+        return *this;
+    }
 
-    class inactive_course_exception : public std::exception
+    ChunkedSet &operator=(ChunkedSet &&other)
     {
-        virtual const char* what() const throw()
-        {
-            return "Incorrect operation on an inactive course.";
-        }
-    };
+        chunks = std::move(other.chunks);
+        count = std::exchange(other.count, 0);
+        return *this;
+    }
 
-    class non_existing_person_exception : public std::exception
+    std::pmr::memory_resource *resource() const noexcept
     {
-        virtual const char* what() const throw()
-        {
-            return "Non-existing person.";
-        }
-    };
+        return chunks.get_allocator().resource();
+    }
 
-    class non_existing_course_exception : public std::exception
+    std::size_t size() const noexcept
     {
-        virtual const char* what() const throw()
-        {
-            return "Non-existing course.";
-        }
-    };
+        return count;
+    }
 
-    // Function checks whether given string satisfies pattern that has * and ?
-    bool satisfies_pattern(const std::string &str,
-                           const std::string &pattern) const noexcept
+    bool empty() const noexcept
     {
-        std::size_t str_idx, ptrn_idx, ptrn_len, str_len;
-        int last_wildcard = -1, backtrack_idx = -1, next_wildcard = -1;
+        return count == 0;
+    }
 
-        str_idx = ptrn_idx = 0;
-        ptrn_len = pattern.size();
-        str_len = str.size();
+    const_iterator begin() const noexcept
+    {
+        return chunks.empty() ? end() : at(0, 0);
+    }
 
-        while (str_idx < str_len)
-        {
-            // If current character in pattern is ? or pattern character and
-            // str character match, we simply do ++ on indexes.
-            if (ptrn_idx < ptrn_len && (pattern[ptrn_idx] == '?' ||
-                                        str[str_idx] == pattern[ptrn_idx]))
-            {
-                str_idx++;
-                ptrn_idx++;
-            }
-            else if (ptrn_idx < ptrn_len && pattern[ptrn_idx] == '*')
-            {
-                last_wildcard = ptrn_idx;
-                next_wildcard = ++ptrn_idx;
-                backtrack_idx = str_idx;
-            }
-            else if (last_wildcard == -1)
-                return false;
-            else
-            {
-                // We didnt find match between str and pattern, also we didnt
-                // find another *, so we need to come back to previous * that
-                // we remembered and increase matched idx. Basically what we do
-                // is we find how long substring in our str is assigned to *.
-                // i.e. Biology and *o?y we do:
-                // 1) match = 0, start_idx = 0, ptrn_idx = 1
-                // 2) o != B but start_idx != -1 so we do match++, ptrn_idx = 1
-                // 3) o != i ---||---
-                // 4) o == o so we do ptrn_idx++ and str_idx++
-                // 5) ? == l ---||---
-                // 6) y != o but start_idx != -1 so we do match++, ptrn_idx = 1
-                // now match = 3 so currently * = Bio
-                // 7) o != l so match++, str_idx = match, * = Biol
-                // 8) o == o, 9) ? == g, 10) y == y
-                ptrn_idx = next_wildcard;
-                str_idx = ++backtrack_idx;
-            }
-        }
+    const_iterator end() const noexcept
+    {
+        const CowPtr<chunk> *dir_end = chunks.data() + chunks.size();
+        return const_iterator(dir_end, dir_end, nullptr);
+    }
 
-        // Pattern can be longer than our string so we need to check if in this
-        // pattern there arent any characters apart from ? and *.
-        for(std::size_t i = ptrn_idx; i < ptrn_len; i++)
-        {
-            if(pattern[i] != '*')
-                 return false;
-        }
-        return true;
+    const Value &back() const noexcept
+    {
+        return chunks.back()->back();
     }
-};
 
-// Specializations:
-// We need add_person specialization cause constructors may differ, and in some
-// of them we need to add active, whereas in others we don't.
-template <>
-inline bool College::add_person<Student>(const std::string &name, 
-    const std::string &surname, bool active)
-{
-    if (people_names.find(std::make_pair(name, surname)) == people_names.end())
+    // Chunks are never empty, so the first chunk whose last value is not
+    // less than key has the first such value of whole set.
+    template <typename K>
+    const_iterator lower_bound(const K &key) const
     {
-        people_names.emplace(std::make_pair(name, surname));
-        person_set.emplace(std::make_shared<Student>(name, surname, active));
-        return true;
+        auto dir = std::partition_point(chunks.begin(), chunks.end(),
+            [&](const CowPtr<chunk> &values)
+            {
+                return compare(values->back(), key);
+            });
+        if (dir == chunks.end())
+            return end();
+
+        return at(dir - chunks.begin(), std::lower_bound((*dir)->begin(),
+            (*dir)->end(), key, compare) - (*dir)->begin());
     }
-    return false;
-}
 
-template <>
-inline bool College::add_person<Teacher>(const std::string &name, 
-    const std::string &surname, bool active)
-{
-    active = true;
-    if (people_names.find(std::make_pair(name, surname)) == people_names.end())
+    template <typename K>
+    const_iterator upper_bound(const K &key) const
     {
-        people_names.emplace(std::make_pair(name, surname));
-        person_set.emplace(std::make_shared<Teacher>(name, surname));
+        auto dir = std::partition_point(chunks.begin(), chunks.end(),
+            [&](const CowPtr<chunk> &values)
+            {
+                return !compare(key, values->back());
+            });
+        if (dir == chunks.end())
+            return end();
 
-        return active;
+        return at(dir - chunks.begin(), std::upper_bound((*dir)->begin(),
+            (*dir)->end(), key, compare) - (*dir)->begin());
     }
-    return false;
-}
 
-template <>
-inline bool College::add_person<PhDStudent>(const std::string &name, 
-    const std::string &surname, bool active)
-{
-    if (people_names.find(std::make_pair(name, surname)) == people_names.end())
+    template <typename K>
+    const_iterator find(const K &key) const
     {
-        people_names.emplace(std::make_pair(name, surname));
-        person_set.emplace(std::make_shared<PhDStudent>(name, surname,
-                                                        active));
-        return true;
+        auto iter = lower_bound(key);
+        if (iter == end() || compare(key, *iter))
+            return end();
+        return iter;
     }
-    return false;
-}
 
-// We need assign_course specializations, because PhDStudent is both a teacher
-// and a student, and we need to assign the given course to the correct
-// data structure based on the specialized type.
-template <>
-inline bool College::assign_course<Student>(
-    const std::shared_ptr<Student> &person, 
-    const std::shared_ptr<Course> &course)
-{
-    if (!person_set.contains(person))
-        throw non_existing_person_exception();
-    else if (!course_set.contains(course))
-        throw non_existing_course_exception();
+    template <typename K>
+    bool contains(const K &key) const
+    {
+        return find(key) != end();
+    }
 
-    if (!course->is_active())
-        throw inactive_course_exception();
+    template <typename... Args>
+    std::pair<const_iterator, bool> emplace(Args &&...args)
+    {
+        return insert(Value(std::forward<Args>(args)...));
+    }
 
-    if (!person->is_active())
-        throw inactive_student_exception();
+    // Hint is used only when it is end() and value is greater than all
+    // the others (values added in order), it is appended then.
+    template <typename... Args>
+    const_iterator emplace_hint(const_iterator hint, Args &&...args)
+    {
+        Value value(std::forward<Args>(args)...);
+        if (hint != end() || (!empty() && !compare(back(), value)))
+            return insert(std::move(value)).first;
 
-    if (person->subjects_I_attend.contains(course))
+        if (chunks.empty() || chunks.back()->size() == chunk_size)
+            add_chunk(chunks.size());
+        chunk &values = chunks.back().unshared();
+        values.push_back(std::move(value));
+        count++;
+        return at(chunks.size() - 1, values.size() - 1);
+    }
+
+    std::pair<const_iterator, bool> insert(Value value)
+    {
+        if (chunks.empty())
+            return {emplace_hint(end(), std::move(value)), true};
+
+        // Value goes to the first chunk whose last value is not less than
+        // it, or at the end of the last chunk.
+        std::size_t index = std::partition_point(chunks.begin(),
+            chunks.end(), [&](const CowPtr<chunk> &values)
+            {
+                return compare(values->back(), value);
+            }) - chunks.begin();
+        index = std::min(index, chunks.size() - 1);
+
+        const chunk &found = *chunks[index];
+        std::size_t offset = std::lower_bound(found.begin(), found.end(),
+            value, compare) - found.begin();
+        if (offset < found.size() && !compare(value, found[offset]))
+            return {at(index, offset), false};
+
+        chunk &values = chunks[index].unshared();
+        values.insert(values.begin() + offset, std::move(value));
+        count++;
+
+        if (values.size() > chunk_size)
+        {
+            // Values appended to the last chunk start a new one, so chunks
+            // filled in order stay full. Otherwise chunk is split in half.
+            std::size_t moved = index + 1 == chunks.size() &&
+                offset + 1 == values.size() ? 1 : values.size() / 2;
+            add_chunk(index + 1);
+            chunk &next = chunks[index + 1].unshared();
+            chunk &first = chunks[index].unshared();
+            next.assign(std::make_move_iterator(first.end() - moved),
+                        std::make_move_iterator(first.end()));
+            first.erase(first.end() - moved, first.end());
+
+            if (offset >= first.size())
+                return {at(index + 1, offset - first.size()), true};
+        }
+
+        return {at(index, offset), true};
+    }
+
+    void erase(const_iterator pos)
+    {
+        std::size_t index = pos.dir - chunks.data();
+        std::size_t offset = pos.pos - (*pos.dir)->data();
+
+        chunk &values = chunks[index].unshared();
+        values.erase(values.begin() + offset);
+        count--;
+
+        if (values.empty())
+            chunks.erase(chunks.begin() + index);
+        else if (values.size() < chunk_size / 4)
+            merge(index);
+    }
+
+    template <typename K>
+    std::size_t erase(const K &key)
+    {
+        auto iter = find(key);
+        if (iter == end())
+            return 0;
+        erase(iter);
+        return 1;
+    }
+
+    // Function returns value at given position that can be changed in
+    // place (without changing its order), copying its chunk if it is shared.
+    Value &unshared(const_iterator pos)
+    {
+        std::size_t index = pos.dir - chunks.data();
+        std::size_t offset = pos.pos - (*pos.dir)->data();
+        return chunks[index].unshared()[offset];
+    }
+
+    void clear() noexcept
+    {
+        chunks.clear();
+        count = 0;
+    }
+
+private:
+    std::pmr::vector<CowPtr<chunk>> chunks;
+    std::size_t count = 0;
+    [[no_unique_address]] Compare compare;
+
+    const_iterator at(std::size_t index, std::size_t offset) const noexcept
+    {
+        return const_iterator(chunks.data() + index,
+                              chunks.data() + chunks.size(),
+                              chunks[index]->data() + offset);
+    }
+
+    void add_chunk(std::size_t index)
+    {
+        auto made = CowPtr<chunk>::make(resource(), resource());
+        chunks.insert(chunks.begin() + index, std::move(made));
+    }
+
+    // Small chunk is merged into its neighbour, if they fit in one chunk,
+    // so removals don't leave many almost empty chunks behind.
+    void merge(std::size_t index)
+    {
+        if (chunks.size() == 1)
+            return;
+        std::size_t other = index + 1 < chunks.size() ? index + 1 : index - 1;
+        if (chunks[index]->size() + chunks[other]->size() > chunk_size)
+            return;
+
+        std::size_t first = std::min(index, other);
+        const chunk &second = *chunks[first + 1];
+        chunk &merged = chunks[first].unshared();
+        merged.insert(merged.end(), second.begin(), second.end());
+        chunks.erase(chunks.begin() + first + 1);
+    }
+};
+
+// Comparator of ChunkedMap - orders pairs by their keys, and compares them
+// with anything Less compares keys with.
+template <typename Key, typename Mapped, typename Less>
+struct ChunkedMapCompare
+{
+    using value_type = std::pair<Key, Mapped>;
+
+    [[no_unique_address]] Less less;
+
+    bool operator()(const value_type &a, const value_type &b) const
+    {
+        return less(a.first, b.first);
+    }
+
+    template <typename K>
+        requires (!std::same_as<K, value_type>)
+    bool operator()(const value_type &a, const K &b) const
+    {
+        return less(a.first, b);
+    }
+
+    template <typename K>
+        requires (!std::same_as<K, value_type>)
+    bool operator()(const K &a, const value_type &b) const
+    {
+        return less(a, b.first);
+    }
+};
+
+// Map on top of ChunkedSet, with the same sharing of chunks between copies.
+// Values are changed in place through ChunkedSet::unshared.
+template <typename Key, typename Mapped, typename Less = std::less<>,
+          std::size_t chunk_size = 256>
+using ChunkedMap = ChunkedSet<std::pair<Key, Mapped>,
+                              ChunkedMapCompare<Key, Mapped, Less>, chunk_size>;
+
+/**
+ * Vector kept in chunks of chunk_size elements, sharing them between copies
+ * the same way as ChunkedSet. It grows and shrinks only at the end.
+ */
+template <typename T, std::size_t chunk_size = 256>
+class ChunkedVector
+{
+    using chunk = std::pmr::vector<T>;
+
+public:
+    explicit ChunkedVector(std::pmr::memory_resource *resource =
+                               std::pmr::get_default_resource()) :
+        chunks(resource) {}
+
+    ChunkedVector(const ChunkedVector &other) :
+        chunks(other.chunks, other.chunks.get_allocator()),
+        count(other.count) {}
+
+    ChunkedVector &operator=(const ChunkedVector &other)
+    {
+        chunks = other.chunks;
+        count = other.count;
+        return *this;
+    }
+
+    std::pmr::memory_resource *resource() const noexcept
+    {
+        return chunks.get_allocator().resource();
+    }
+
+    std::size_t size() const noexcept
+    {
+        return count;
+    }
+
+    bool empty() const noexcept
+    {
+        return count == 0;
+    }
+
+    const T &operator[](std::size_t i) const noexcept
+    {
+        return (*chunks[i / chunk_size])[i % chunk_size];
+    }
+
+    const T &back() const noexcept
+    {
+        return (*this)[count - 1];
+    }
+
+    // True if element can be changed in place without copying its chunk.
+    bool unique(std::size_t i) const noexcept
+    {
+        return chunks[i / chunk_size].unique();
+    }
+
+    // Function returns element that can be changed in place, copying its
+    // chunk first if it is shared.
+    T &unshared(std::size_t i)
+    {
+        return chunks[i / chunk_size].unshared()[i % chunk_size];
+    }
+
+    void push_back(T value)
+    {
+        if (count % chunk_size == 0)
+            chunks.push_back(CowPtr<chunk>::make(resource(), resource()));
+        chunks.back().unshared().push_back(std::move(value));
+        count++;
+    }
+
+    void pop_back()
+    {
+        if (--count % chunk_size == 0)
+            chunks.pop_back();
+        else
+            chunks.back().unshared().pop_back();
+    }
+
+private:
+    std::pmr::vector<CowPtr<chunk>> chunks;
+    std::size_t count = 0;
+};
+
+/**
+ * Trigram index of strings, used to answer patterns that have no literal
+ * prefix (i.e. "*ski" or "*bio*"). For each three-character substring (gram)
+ * we keep set of keys whose indexed string contains it. Every string that
+ * satisfies pattern has to contain all grams of literal fragments of that
+ * pattern, so intersection of their posting sets gives candidates that still
+ * have to be checked with a proper matcher.
+ */
+template <typename Key>
+class NgramIndex
+{
+public:
+    static constexpr std::size_t gram_len = 3;
+
+    // Grams present in more than max_posting_size strings are dropped from
+    // index (they narrow down searches poorly anyway). 0 means no limit.
+    explicit NgramIndex(std::size_t max_posting_size = 0) :
+        max_postings(max_posting_size) {}
+
+    void insert(const std::string &str, const Key &key)
+    {
+        for (std::size_t i = 0; i + gram_len <= str.size(); i++)
+        {
+            std::string gram = str.substr(i, gram_len);
+            if (saturated.contains(gram))
+                continue;
+
+            auto iter = postings.find(gram);
+            if (iter == postings.end())
+                iter = postings.emplace(gram, ChunkedSet<Key>()).first;
+            auto &posting = postings.unshared(iter).second;
+            posting.emplace(key);
+
+            if (max_postings != 0 && posting.size() > max_postings)
+            {
+                postings.erase(gram);
+                saturated.emplace(std::move(gram));
+            }
+        }
+    }
+
+    void erase(const std::string &str, const Key &key)
+    {
+        for (std::size_t i = 0; i + gram_len <= str.size(); i++)
+        {
+            std::string gram = str.substr(i, gram_len);
+            auto iter = postings.find(gram);
+            if (iter == postings.end())
+                continue;
+
+            // Changed posting may be a copy, so iter no longer points to it.
+            auto &posting = postings.unshared(iter).second;
+            posting.erase(key);
+            if (posting.empty())
+                postings.erase(gram);
+        }
+    }
+
+    void clear() noexcept
+    {
+        postings.clear();
+        saturated.clear();
+    }
+
+    /**
+     * Function narrows down candidates for given pattern. If result is empty
+     * it gets set of keys matching all indexed grams of pattern, otherwise
+     * it is intersected with it. If pattern has no indexed gram, result
+     * stays untouched.
+     */
+    void narrow(std::string_view pattern,
+                std::optional<std::set<Key>> &result) const
+    {
+        std::vector<const ChunkedSet<Key> *> lists;
+        static const ChunkedSet<Key> empty_posting;
+
+        std::size_t begin = 0;
+        while (begin < pattern.size())
+        {
+            std::size_t end = pattern.find_first_of("*?", begin);
+            if (end == std::string_view::npos)
+                end = pattern.size();
+
+            for (std::size_t i = begin; i + gram_len <= end; i++)
+            {
+                std::string gram(pattern.substr(i, gram_len));
+                if (saturated.contains(gram))
+                    continue;
+
+                // Gram absent from index means no string contains it.
+                auto iter = postings.find(gram);
+                lists.push_back(iter == postings.end() ?
+                    &empty_posting : &iter->second);
+            }
+
+            begin = end + 1;
+        }
+
+        if (lists.empty())
+            return;
+
+        // Intersecting from the smallest set keeps intermediate sets small.
+        std::sort(lists.begin(), lists.end(),
+            [](const ChunkedSet<Key> *a, const ChunkedSet<Key> *b)
+            {
+                return a->size() < b->size();
+            });
+
+        auto iter = lists.begin();
+        if (!result.has_value())
+        {
+            result.emplace((*iter)->begin(), (*iter)->end());
+            ++iter;
+        }
+
+        for (; iter != lists.end() && !result->empty(); ++iter)
+        {
+            std::set<Key> intersection;
+            std::set_intersection(result->begin(), result->end(),
+                (*iter)->begin(), (*iter)->end(),
+                std::inserter(intersection, intersection.end()));
+            result->swap(intersection);
+        }
+    }
+
+private:
+    // Chunked, so copy of index (kept by snapshot of college) shares them
+    // and a change copies only chunks it touches.
+    ChunkedMap<std::string, ChunkedSet<Key>> postings;
+    ChunkedSet<std::string> saturated;
+    std::size_t max_postings;
+};
+
+/**
+ * Opt-in metrics of College - number of calls, latency histogram and sizes of
+ * results of every public function, and work done by wildcard matcher.
+ * Counters are atomics updated without locks, so recording is cheap and
+ * metrics can be collected while college is used. Latency histogram has
+ * power-of-two buckets: bucket i counts calls that took less than 2^i ns (and
+ * at least 2^(i-1) ns), the last one counts everything longer.
+ */
+class CollegeMetrics
+{
+public:
+    enum operation : std::size_t
+    {
+        add_course, find_courses, change_course_activeness, remove_course,
+        set_ngram_index, add_person, change_student_activeness, find_people,
+        find_course_members, assign_course, add_people, add_courses,
+        assign_course_batch, snapshot, query, save, bulk_import,
+        remove_person, unassign_course, operation_count
+    };
+
+    static constexpr std::array<std::string_view, operation_count>
+        operation_names{
+            "add_course", "find_courses", "change_course_activeness",
+            "remove_course", "set_ngram_index", "add_person",
+            "change_student_activeness", "find_people", "find_course_members",
+            "assign_course", "add_people", "add_courses",
+            "assign_course_batch", "snapshot", "query", "save", "bulk_import",
+            "remove_person", "unassign_course"};
+
+    static constexpr std::size_t latency_buckets = 40;
+
+    // Work of wildcard matcher: strings matched against patterns, characters
+    // of strings examined and backtracks (places where segment of pattern
+    // between * was compared and didn't match).
+    struct pattern_work
+    {
+        std::uint64_t matches = 0;
+        std::uint64_t chars = 0;
+        std::uint64_t backtracks = 0;
+    };
+
+    struct operation_snapshot
+    {
+        std::string_view name;
+        std::uint64_t calls = 0;
+        std::uint64_t total_ns = 0;
+        // Sum of sizes of returned sets (only for functions returning them).
+        std::uint64_t results = 0;
+        std::array<std::uint64_t, latency_buckets> latency{};
+
+        // Upper bound of given quantile (i.e. 0.99) of latency, in ns.
+        std::uint64_t latency_quantile(double quantile) const noexcept
+        {
+            auto rank = static_cast<std::uint64_t>(quantile * calls);
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < latency_buckets; i++)
+            {
+                seen += latency[i];
+                if (seen > rank)
+                    return std::uint64_t(1) << i;
+            }
+            return calls == 0 ? 0 : std::uint64_t(1) << latency_buckets;
+        }
+    };
+
+    struct metrics_snapshot
+    {
+        std::vector<operation_snapshot> operations;
+        pattern_work patterns;
+
+        std::string to_json() const
+        {
+            std::string out = "{\"operations\": [";
+            for (std::size_t i = 0; i < operations.size(); i++)
+            {
+                const auto &op = operations[i];
+                out += (i > 0 ? ", " : "");
+                out += "{\"name\": \"" + std::string(op.name) + "\"";
+                out += ", \"calls\": " + std::to_string(op.calls);
+                out += ", \"total_ns\": " + std::to_string(op.total_ns);
+                out += ", \"results\": " + std::to_string(op.results);
+                out += ", \"p50_ns\": " +
+                    std::to_string(op.latency_quantile(0.5));
+                out += ", \"p99_ns\": " +
+                    std::to_string(op.latency_quantile(0.99));
+                out += ", \"latency_buckets\": [";
+                for (std::size_t b = 0; b < latency_buckets; b++)
+                    out += (b > 0 ? ", " : "") + std::to_string(op.latency[b]);
+                out += "]}";
+            }
+            out += "], \"pattern_matches\": " +
+                std::to_string(patterns.matches);
+            out += ", \"pattern_chars\": " + std::to_string(patterns.chars);
+            out += ", \"pattern_backtracks\": " +
+                std::to_string(patterns.backtracks) + "}";
+            return out;
+        }
+
+        // Prometheus text format, latency as cumulative histogram.
+        std::string to_prometheus() const
+        {
+            std::string out;
+            out += "# TYPE college_calls_total counter\n";
+            for (const auto &op : operations)
+                out += "college_calls_total{operation=\"" +
+                    std::string(op.name) + "\"} " +
+                    std::to_string(op.calls) + "\n";
+
+            out += "# TYPE college_results_total counter\n";
+            for (const auto &op : operations)
+                out += "college_results_total{operation=\"" +
+                    std::string(op.name) + "\"} " +
+                    std::to_string(op.results) + "\n";
+
+            out += "# TYPE college_latency_ns histogram\n";
+            for (const auto &op : operations)
+            {
+                std::string labels = "operation=\"" + std::string(op.name) +
+                    "\"";
+                std::uint64_t cumulative = 0;
+                for (std::size_t b = 0; b + 1 < latency_buckets; b++)
+                {
+                    cumulative += op.latency[b];
+                    out += "college_latency_ns_bucket{" + labels + ",le=\"" +
+                        std::to_string(std::uint64_t(1) << b) + "\"} " +
+                        std::to_string(cumulative) + "\n";
+                }
+                out += "college_latency_ns_bucket{" + labels +
+                    ",le=\"+Inf\"} " + std::to_string(op.calls) + "\n";
+                out += "college_latency_ns_sum{" + labels + "} " +
+                    std::to_string(op.total_ns) + "\n";
+                out += "college_latency_ns_count{" + labels + "} " +
+                    std::to_string(op.calls) + "\n";
+            }
+
+            out += "# TYPE college_pattern_matches_total counter\n";
+            out += "college_pattern_matches_total " +
+                std::to_string(patterns.matches) + "\n";
+            out += "# TYPE college_pattern_chars_total counter\n";
+            out += "college_pattern_chars_total " +
+                std::to_string(patterns.chars) + "\n";
+            out += "# TYPE college_pattern_backtracks_total counter\n";
+            out += "college_pattern_backtracks_total " +
+                std::to_string(patterns.backtracks) + "\n";
+            return out;
+        }
+    };
+
+    void record(operation op, std::chrono::nanoseconds latency,
+                std::size_t results, const pattern_work &work) noexcept
+    {
+        auto ns = static_cast<std::uint64_t>(std::max<std::int64_t>(
+            latency.count(), 0));
+        auto bucket = std::min<std::size_t>(std::bit_width(ns),
+                                            latency_buckets - 1);
+
+        operation_counters &counters = operations[op];
+        counters.calls.fetch_add(1, std::memory_order_relaxed);
+        counters.total_ns.fetch_add(ns, std::memory_order_relaxed);
+        counters.results.fetch_add(results, std::memory_order_relaxed);
+        counters.latency[bucket].fetch_add(1, std::memory_order_relaxed);
+
+        if (work.matches > 0)
+        {
+            pattern_matches.fetch_add(work.matches, std::memory_order_relaxed);
+            pattern_chars.fetch_add(work.chars, std::memory_order_relaxed);
+            pattern_backtracks.fetch_add(work.backtracks,
+                                         std::memory_order_relaxed);
+        }
+    }
+
+    metrics_snapshot collect() const
+    {
+        metrics_snapshot result;
+        for (std::size_t op = 0; op < operation_count; op++)
+        {
+            const operation_counters &counters = operations[op];
+            operation_snapshot op_snapshot;
+            op_snapshot.name = operation_names[op];
+            op_snapshot.calls = counters.calls.load(std::memory_order_relaxed);
+            op_snapshot.total_ns =
+                counters.total_ns.load(std::memory_order_relaxed);
+            op_snapshot.results =
+                counters.results.load(std::memory_order_relaxed);
+            for (std::size_t b = 0; b < latency_buckets; b++)
+                op_snapshot.latency[b] =
+                    counters.latency[b].load(std::memory_order_relaxed);
+            result.operations.push_back(op_snapshot);
+        }
+
+        result.patterns.matches =
+            pattern_matches.load(std::memory_order_relaxed);
+        result.patterns.chars = pattern_chars.load(std::memory_order_relaxed);
+        result.patterns.backtracks =
+            pattern_backtracks.load(std::memory_order_relaxed);
+        return result;
+    }
+
+    void reset() noexcept
+    {
+        for (auto &counters : operations)
+        {
+            counters.calls = 0;
+            counters.total_ns = 0;
+            counters.results = 0;
+            for (auto &bucket : counters.latency)
+                bucket = 0;
+        }
+        pattern_matches = 0;
+        pattern_chars = 0;
+        pattern_backtracks = 0;
+    }
+
+private:
+    // Counters of every operation have their own cache lines, so threads
+    // calling different functions don't fight over them.
+    struct alignas(64) operation_counters
+    {
+        std::atomic<std::uint64_t> calls = 0;
+        std::atomic<std::uint64_t> total_ns = 0;
+        std::atomic<std::uint64_t> results = 0;
+        std::array<std::atomic<std::uint64_t>, latency_buckets> latency{};
+    };
+
+    std::array<operation_counters, operation_count> operations;
+    alignas(64) std::atomic<std::uint64_t> pattern_matches = 0;
+    std::atomic<std::uint64_t> pattern_chars = 0;
+    std::atomic<std::uint64_t> pattern_backtracks = 0;
+};
+
+class CollegeSnapshot;
+
+template <typename Scan>
+class CollegeQuery;
+
+/**
+ * Pattern given as template argument, i.e. in find<Student, "*", "Kowal*">().
+ * Such pattern is known when program is compiled, so College can decide then
+ * how it has to be matched.
+ */
+template <std::size_t N>
+struct FixedPattern
+{
+    constexpr FixedPattern(const char (&pattern)[N]) noexcept
+    {
+        std::copy_n(pattern, N, text);
+    }
+
+    constexpr std::string_view view() const noexcept
+    {
+        return std::string_view(text, N - 1);
+    }
+
+    char text[N];
+};
+
+class College
+{
+    // Scans of people and courses, defined in private part below, are
+    // needed for types of lazy query results. By default they match patterns
+    // given at run time.
+    struct runtime_matcher;
+
+    template <IsAcademic T, typename NameMatcher = runtime_matcher,
+              typename SurnameMatcher = runtime_matcher>
+    class people_scan;
+    template <typename Matcher = runtime_matcher>
+    class course_scan;
+
+public:
+    College() : College(std::pmr::get_default_resource()) {}
+
+    /**
+     * College allocating its maps, slabs of ids and indexes, objects of
+     * people and courses, their sets of courses and rosters of courses from
+     * given memory resource. Strings are not allocated from it - names
+     * (also pooled ones), surnames and names of courses use default
+     * allocator - and neither is trigram index (see set_ngram_index). With
+     * i.e. std::pmr::monotonic_buffer_resource most allocations of building
+     * big college come from one buffer, and releasing it doesn't free nodes
+     * one by one. Resource has to outlive college, its copies and snapshots,
+     * and every person and course taken from them.
+     */
+    explicit College(std::pmr::memory_resource *resource) :
+        state(std::allocate_shared<college_state>(
+            std::pmr::polymorphic_allocator<college_state>(resource),
+            resource)) {}
+
+    // Copy shares state with original college until one of them changes
+    // (the same way as snapshots do), objects of people and courses are
+    // always shared. Copy gets fresh locks. Rosters and assignments belong
+    // to each college, but what is kept in shared objects is seen by all
+    // copies: get_courses() of person lists courses assigned to it through
+    // any of them (and loses ones unassigned or removed through any), and
+    // removal of course through one copy makes course inactive in all.
+    // Counters of active students and courses of a copy don't follow such
+    // changes made through the others.
+    College(const College &other) : state(other.share_state()),
+        state_shared(true), version(other.get_version()) {}
+
+    // Assigned contents are compacted into college file of open log (the
+    // same way as by compact_log, but waiting for compaction that already
+    // runs), so that later changes are logged against them.
+    College &operator=(const College &other)
+    {
+        if (this != &other)
+        {
+            auto other_state = other.share_state();
+
+            std::shared_ptr<mutation_log> log;
+            {
+                std::shared_lock lock(locks.structure);
+                log = logging.log;
+            }
+            bool compact = log != nullptr && log->prepare_compaction(true);
+
+            std::unique_lock lock(locks.structure);
+            // Log which can't be compacted would describe other contents.
+            if (log != nullptr && !compact && logging.log == log)
+                throw college_file_exception();
+
+            state = std::move(other_state);
+            state_shared = true;
+            version.fetch_add(1, std::memory_order_relaxed);
+            if (compact)
+                start_compaction(log);
+        }
+        return *this;
+    }
+
+    /**
+     * Function checks if course of given name is present in our college
+     * (names of courses are unique), and if not it creates such 
+     * course and adds it to set of courses and returns true.
+     */
+    bool add_course(const std::string &name, bool active = true)
+    {
+        measured_call call(*this, CollegeMetrics::add_course);
+        logged_call logged(*this);
+
+        std::unique_lock lock(locks.structure);
+
+        if (state->course_names.find(name) == state->course_names.end())
+        {
+            auto course = make_course(name, active);
+
+            unshare_state();
+            state->add_course(course);
+            logged.record(log_format::add_course, name, active);
+            bump_version();
+
+            logged.commit(lock);
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Function returns set of shared_ptrs to courses which names satisfy given
+     * pattern. Courses in set are in lexycographic order by their names.
+     * Function does not modify anything in our college.
+     */
+    auto find_courses(const std::string &pattern) const;
+
+    bool change_course_activeness(const std::shared_ptr<Course> &course,
+                                  bool active)
+    {
+        measured_call call(*this, CollegeMetrics::change_course_activeness);
+        logged_call logged(*this);
+
+        // Counter of active courses is a part of state, so state can't be
+        // shared with snapshots.
+        auto lock = lock_unshared_state();
+
+        if (!state->has_course(course))
+            return false;
+
+        // Shard of course keeps concurrent changes in the same order in log
+        // as in college.
+        std::unique_lock course_lock(locks.shard(course.get()));
+        if (set_activeness(*course, active))
+            logged.record(log_format::course_active, course->get_name(),
+                          active);
+        bump_version();
+
+        logged.commit(course_lock, lock);
+        return true;
+    }
+
+    /**
+     * Function removes given course from our college. Course is found by
+     * comparing shared ptrs, not courses' names, since we can have two courses
+     * with the same name, but in different colleges, so looking for course
+     * using its name would be a mistake.
+     */
+    bool remove_course(const std::shared_ptr<Course> &course)
+    {
+        measured_call call(*this, CollegeMetrics::remove_course);
+        logged_call logged(*this);
+
+        std::unique_lock lock(locks.structure);
+
+        if (!state->has_course(course))
+            return false;
+
+        unshare_state();
+
+        // We remove whole course (together with its roster, nobody can be
+        // assigned to it anymore) from our college and change activeness.
+        state->remove_course(course->id);
+        course->change_activeness(false);
+        logged.record(log_format::remove_course, course->get_name());
+        bump_version();
+
+        logged.commit(lock);
+        return true;
+    }
+
+    /**
+     * Function removes given person from our college, together with all its
+     * assignments - it disappears from rosters of its courses, and they
+     * disappear from its sets of courses. Only its own courses (the ones it
+     * has in this college) are visited, so it costs O(number of them) and
+     * not O(size of college). Like remove_course, it compares shared ptrs,
+     * not names.
+     */
+    bool remove_person(const std::shared_ptr<Person> &person)
+    {
+        measured_call call(*this, CollegeMetrics::remove_person);
+        logged_call logged(*this);
+
+        std::unique_lock lock(locks.structure);
+
+        if (!state->has_person(person))
+            return false;
+
+        unshare_state();
+
+        state->remove_person(person->id);
+        logged.record(log_format::remove_person, person->get_name(),
+                      person->get_surname());
+        bump_version();
+
+        logged.commit(lock);
+        return true;
+    }
+
+    /**
+     * Function enables (or disables) trigram index used by find<T> and
+     * find_courses for patterns without literal prefix, like "*ski".
+     * Enabling builds index from people and courses already in college.
+     * max_posting_size is memory knob - trigrams present in more than that
+     * many names are not indexed at all (0 means no limit).
+     */
+    void set_ngram_index(bool enabled, std::size_t max_posting_size = 0)
+    {
+        measured_call call(*this, CollegeMetrics::set_ngram_index);
+
+        std::unique_lock lock(locks.structure);
+
+        unshare_state();
+        state->ngrams = {};
+
+        if (enabled)
+            state->index_ngrams(max_posting_size);
+    }
+
+    /**
+     * Function enables (or disables) metrics of calls of our public functions
+     * (see CollegeMetrics). Disabled metrics cost one atomic load per call.
+     * Counters survive disabling, reset_metrics() clears them. Lazy queries
+     * are counted when they are made, not when they are consumed, and copy of
+     * college starts without metrics.
+     */
+    void set_metrics(bool enabled)
+    {
+        std::unique_lock lock(locks.structure);
+
+        if (enabled && metrics_storage == nullptr)
+            metrics_storage = std::make_unique<CollegeMetrics>();
+        metrics.store(enabled ? metrics_storage.get() : nullptr,
+                      std::memory_order_release);
+    }
+
+    // Function returns current values of metrics (zeros if they were never
+    // enabled), ready to be exported as JSON or in Prometheus format.
+    CollegeMetrics::metrics_snapshot get_metrics() const
+    {
+        std::shared_lock lock(locks.structure);
+
+        if (metrics_storage == nullptr)
+            return CollegeMetrics().collect();
+        return metrics_storage->collect();
+    }
+
+    void reset_metrics()
+    {
+        std::shared_lock lock(locks.structure);
+
+        if (metrics_storage != nullptr)
+            metrics_storage->reset();
+    }
+
+    struct query_cache_stats
+    {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+        std::size_t size = 0;
+        std::size_t capacity = 0;
+    };
+
+    /**
+     * Function enables cache of results of find_courses and find<T> for
+     * patterns with wildcards (others are answered by one lookup anyway).
+     * Cache keeps at most capacity results and drops least recently used
+     * ones first, 0 disables it. Every result remembers version of college
+     * it was computed for, and every change of college bumps version, so
+     * cache never returns stale result. Hit returns copy of cached set - it
+     * saves the search, not the copy. Changing capacity clears cache and its
+     * statistics.
+     */
+    void set_query_cache(std::size_t capacity)
+    {
+        std::lock_guard lock(query_cache.mutex);
+
+        query_cache.entries.clear();
+        query_cache.index.clear();
+        query_cache.stats = query_cache_stats();
+        query_cache.stats.capacity = capacity;
+        query_cache.capacity.store(capacity, std::memory_order_relaxed);
+    }
+
+    query_cache_stats get_query_cache_stats() const
+    {
+        std::lock_guard lock(query_cache.mutex);
+
+        query_cache_stats stats = query_cache.stats;
+        stats.size = query_cache.entries.size();
+        return stats;
+    }
+
+    /**
+     * Function lets find<T>, find_ids<T>, find_courses and find_course_ids
+     * run on given number of threads when they have to check everybody
+     * (everything) in college - patterns without literal prefix, which
+     * trigram index (if enabled) can't narrow down. People (courses) are
+     * split into chunks matched in parallel, and results are merged in the
+     * usual order. Colleges with fewer than min_scan_size people (courses)
+     * are still scanned by calling thread, and threads below 2 disable
+     * parallel scans. Calling thread is one of the threads, and one
+     * parallel scan runs at a time - scans started meanwhile run on their
+     * calling threads. Work of patterns matched in parallel isn't counted
+     * in metrics. Copy of college scans on calling threads.
+     */
+    void set_parallel_scan(std::size_t threads,
+                           std::size_t min_scan_size = 100000)
+    {
+        std::shared_ptr<scan_pool> pool;
+        if (threads > 1)
+            pool = std::make_shared<scan_pool>(threads - 1);
+
+        std::lock_guard lock(parallel_scans.mutex);
+        parallel_scans.min_size = min_scan_size;
+        // Old pool (if any) finishes its scan and stops when last query
+        // using it is done.
+        parallel_scans.pool.swap(pool);
+        parallel_scans.enabled.store(parallel_scans.pool != nullptr,
+                                     std::memory_order_relaxed);
+    }
+
+    /**
+     * Function add new person to college if person of given name and surname
+     * isn't alread present in it. We need specializations since some
+     * constructors need active parameter while others don't.
+     */
+    template <typename T>
+    bool add_person(const std::string &name, const std::string &surname, bool active = true);
+
+    /**
+     * Function finds given student by comparing shared pointers in college 
+     * set, since we can have students of same names but in different colleges.
+     * Given pointer already points to a student, so once we know it belongs
+     * to our college we can change it directly, without any casts.
+     */
+    bool change_student_activeness(const std::shared_ptr<Student> &student,
+                                   bool active)
+    {
+        measured_call call(*this, CollegeMetrics::change_student_activeness);
+        logged_call logged(*this);
+
+        auto lock = lock_unshared_state();
+
+        if (!state->has_person(student))
+            return false;
+
+        std::unique_lock student_lock(locks.shard(student.get()));
+        if (set_activeness(*student, active))
+            logged.record(log_format::student_active, student->get_name(),
+                          student->get_surname(), active);
+        bump_version();
+
+        logged.commit(student_lock, lock);
+        return true;
+    }
+
+    /**
+     * Function finds people in college that name and surname have given
+     * patterns and these people are of type T. We use concept IsAcademic here
+     * since we need to ensure that type T has get_surname and get_name methods
+     * in order not to make many similar outside of class specializations.
+     */
+    template <IsAcademic T>
+    auto find(const std::string &name_pattern,
+              const std::string &surname_pattern) const;
+
+    template <typename T>
+    auto find(const std::shared_ptr<Course>& course);
+
+    /**
+     * Aggregates kept up to date by every change of college, so they cost
+     * O(1) (top_courses O(k)) instead of a query per course. Changes of
+     * activeness are counted when they are made through college - people
+     * and courses are shared with copies of college, whose counters don't
+     * see changes made through this one.
+     */
+    std::size_t count_active_students() const
+    {
+        std::shared_lock lock(locks.structure);
+        return state->active_students.load(std::memory_order_relaxed);
+    }
+
+    std::size_t count_active_courses() const
+    {
+        std::shared_lock lock(locks.structure);
+        return state->active_courses.load(std::memory_order_relaxed);
+    }
+
+    // Number of students (teachers) of given course, 0 if it isn't in
+    // college.
+    template <StudentTeacher T>
+    std::size_t count(const std::shared_ptr<Course> &course) const
+    {
+        std::shared_lock lock(locks.structure);
+
+        if (!state->has_course(course))
+            return 0;
+
+        // Roster can be replaced by its copy under lock of its shard.
+        std::lock_guard roster_lock(locks.shard(course.get()));
+        return state->find_roster(course)->members<T>().size();
+    }
+
+    // Number of courses given person attends (handles), 0 if person isn't
+    // in college.
+    template <StudentTeacher T>
+    std::size_t count_courses(const std::shared_ptr<T> &person) const
+    {
+        std::shared_lock lock(locks.structure);
+
+        auto entry = state->find_person(person.get());
+        if (entry == nullptr)
+            return 0;
+
+        // Number is changed in place under lock of person's shard.
+        std::lock_guard person_lock(locks.shard(person.get()));
+        return entry->template courses<T>();
+    }
+
+    // Copy of courses given person attends (handles), empty if person isn't
+    // in college. Unlike Student::get_courses(), it can be called while
+    // other threads assign courses to the same person.
+    template <StudentTeacher T>
+    auto get_courses(const std::shared_ptr<T> &person) const
+    {
+        using course_set = std::remove_cvref_t<decltype(courses_of(*person))>;
+
+        std::shared_lock lock(locks.structure);
+
+        if (!state->has_person(person))
+            return course_set();
+
+        // Set is changed in place under lock of person's shard.
+        std::lock_guard person_lock(locks.shard(person.get()));
+        return course_set(courses_of(*person));
+    }
+
+    struct course_enrollment
+    {
+        std::shared_ptr<Course> course;
+        std::size_t students;
+    };
+
+    // At most k courses with the most students, courses with the same
+    // number of students in order of names.
+    std::vector<course_enrollment> top_courses(std::size_t k) const
+    {
+        std::shared_lock lock(locks.structure);
+        return state->top_courses(k);
+    }
+
+    /**
+     * Versions of find_courses and find<T> for patterns known when program
+     * is compiled, i.e. find<PhDStudent, "*", "Kowal*">(). Kind of every
+     * pattern is decided at compile time too: "*" isn't checked at all,
+     * patterns without wildcards are compared exactly, and ones with only
+     * trailing or leading * are compared as prefixes or suffixes. Results are
+     * the same (and of the same types) as for patterns given at run time.
+     */
+    template <FixedPattern pattern>
+    auto find_courses() const;
+
+    template <IsAcademic T, FixedPattern name_pattern,
+              FixedPattern surname_pattern>
+    auto find() const;
+
+    /**
+     * Versions of find_courses and find<T> building their results in given
+     * memory resource, i.e. scratch arena released once results are used
+     * (results of the other versions use default resource). They don't use
+     * query cache, since cached results live in default resource.
+     */
+    auto find_courses(const std::string &pattern,
+                      std::pmr::memory_resource *scratch) const;
+
+    template <IsAcademic T>
+    auto find(const std::string &name_pattern,
+              const std::string &surname_pattern,
+              std::pmr::memory_resource *scratch) const;
+
+    /**
+     * Alternative API identifying people and courses by ids - dense numbers
+     * given by college to everyone and everything added to it (0, 1, 2...).
+     * Ids of removed people (courses) are given to ones added later, so
+     * ids stay dense under churn, and id kept after removal may refer to
+     * somebody else. Copies and snapshots of college share ids of people
+     * and courses they share. Queries returning ids don't copy any
+     * shared_ptr, so they don't touch reference counters of found objects -
+     * contended counters are what makes many threads querying the same
+     * people slow. Results are in the same order as results of the shared_ptr
+     * versions of queries. Functions getting shared_ptrs of ids (and the
+     * other way around) connect both APIs.
+     */
+    using person_id = std::uint32_t;
+    using course_id = std::uint32_t;
+
+    std::optional<person_id> get_id(
+        const std::shared_ptr<Person> &person) const
+    {
+        std::shared_lock lock(locks.structure);
+
+        auto entry = person == nullptr ? nullptr :
+            state->person_at(person->id);
+        if (entry == nullptr || entry->person != person)
+            return std::nullopt;
+        return person->id;
+    }
+
+    std::optional<course_id> get_id(
+        const std::shared_ptr<Course> &course) const
+    {
+        std::shared_lock lock(locks.structure);
+
+        auto entry = course == nullptr ? nullptr :
+            state->course_at(course->id);
+        if (entry == nullptr || entry->course != course)
+            return std::nullopt;
+        return course->id;
+    }
+
+    // Functions return nullptr if there is no such person of type T (or no
+    // such course) in college.
+    template <IsAcademic T = Person>
+    std::shared_ptr<T> get_person(person_id id) const
+    {
+        std::shared_lock lock(locks.structure);
+
+        auto entry = state->person_at(id);
+        return entry == nullptr ? nullptr : entry->template as<T>();
+    }
+
+    std::shared_ptr<Course> get_course(course_id id) const
+    {
+        std::shared_lock lock(locks.structure);
+
+        auto entry = state->course_at(id);
+        return entry == nullptr ? nullptr : entry->course;
+    }
+
+    std::vector<course_id> find_course_ids(const std::string &pattern) const
+    {
+        measured_call call(*this, CollegeMetrics::find_courses);
+        std::shared_lock lock(locks.structure);
+
+        auto pool = scan_pool_for(state->course_names.size());
+        auto result = state->find_course_ids(pattern, pool.get());
+        call.set_results(result.size());
+        return result;
+    }
+
+    template <IsAcademic T>
+    std::vector<person_id> find_ids(const std::string &name_pattern,
+                                    const std::string &surname_pattern) const
+    {
+        measured_call call(*this, CollegeMetrics::find_people);
+        std::shared_lock lock(locks.structure);
+
+        auto pool = scan_pool_for(state->people_names.size());
+        auto result = state->find_ids<T>(name_pattern, surname_pattern,
+                                         pool.get());
+        call.set_results(result.size());
+        return result;
+    }
+
+    template <StudentTeacher T>
+    std::vector<person_id> find_ids(course_id course) const
+    {
+        measured_call call(*this, CollegeMetrics::find_course_members);
+        std::shared_lock lock(locks.structure);
+
+        auto entry = state->course_at(course);
+        if (entry == nullptr)
+            return {};
+
+        // Roster can be replaced by its copy under lock of its shard.
+        std::lock_guard roster_lock(locks.shard(entry->course.get()));
+
+        auto result = member_ids(entry->roster->members<T>());
+        call.set_results(result.size());
+        return result;
+    }
+
+    // The same as assign_course for shared_ptrs (and throws for the same
+    // reasons).
+    template <StudentTeacher T>
+    bool assign_course(person_id person, course_id course);
+
+    /**
+    * Functions assigns the given course to the given person, as long as both
+    * the person and course are active (person must be active if 
+    * it is a student), and both course and person exist in this 
+    * college object. StudentTeacher concept ensures that this function
+    * will only accept students or teachers (or classes derived from them).
+    */
+    template <StudentTeacher T>
+    bool assign_course(const std::shared_ptr<T> &person,
+                       const std::shared_ptr<Course> &course);
+
+    /**
+     * Function undoes assign_course - removes given course from courses
+     * person attends (handles) and person from roster of course. Returns
+     * false if person wasn't assigned to course. Unlike assign_course, it
+     * works for inactive courses and students too, so they can be cleaned
+     * up. It throws the same exceptions if person or course is not in
+     * college.
+     */
+    template <StudentTeacher T>
+    bool unassign_course(const std::shared_ptr<T> &person,
+                         const std::shared_ptr<Course> &course)
+    {
+        measured_call call(*this, CollegeMetrics::unassign_course);
+        logged_call logged(*this);
+
+        auto lock = lock_unshared_state(course.get(), person.get());
+
+        if (!state->has_person(person))
+            throw non_existing_person_exception();
+        else if (!state->has_course(course))
+            throw non_existing_course_exception();
+
+        auto entities_lock = locks.lock_entities(person.get(), course.get());
+
+        if (!state->template remove_assignment<T>(person->id, course->id))
+            return false;
+        college_state::unlink(courses_of<T>(*person), course);
+
+        course_roster &roster = state->unshared_roster(course->id);
+        std::size_t students_before = roster.students.size();
+        roster.template members<T>().erase(person);
+        state->students_changed(state->courses_by_id[course->id],
+                                students_before);
+        logged.record(log_format::unassign, log_format::kind<T>(),
+                      person->get_name(), person->get_surname(),
+                      course->get_name());
+        bump_version();
+
+        logged.commit(entities_lock, lock);
+        return true;
+    }
+
+    /**
+     * Batch versions of add_person and add_course taking range of (name,
+     * surname) pairs or of names. Whole batch is added under one lock and in
+     * sorted order, so one lookup finds both duplicate and place for new
+     * element. Returned bitmap tells which items (in order of given range)
+     * were added - like add_person and add_course, false means that person
+     * or course already was in college (or earlier in the same range).
+     */
+    template <typename T, std::ranges::input_range R>
+        requires IsAcademic<T> && (!std::same_as<T, Person>)
+    std::vector<bool> add_people(R &&people, bool active = true);
+
+    template <std::ranges::input_range R>
+    std::vector<bool> add_courses(R &&names, bool active = true);
+
+    /**
+     * Batch versions of assign_course - many people to one course or one
+     * person to many courses. Course (person) is validated once, and all
+     * items are validated before anything is changed, so if function throws
+     * (for the same reasons as assign_course does) college stays unchanged.
+     * Returned bitmap tells which items were assigned, false means they
+     * already were. Whole batch is done under one exclusive lock.
+     */
+    template <StudentTeacher T, std::ranges::input_range R>
+    std::vector<bool> assign_course(R &&people,
+                                    const std::shared_ptr<Course> &course);
+
+    template <StudentTeacher T, std::ranges::input_range R>
+    std::vector<bool> assign_course(const std::shared_ptr<T> &person,
+                                    R &&courses);
+
+    /**
+     * Function returns immutable view of current state of our college. It
+     * is cheap - snapshot shares state with college. The first change of
+     * college after snapshot copies only directories of chunks its
+     * containers are split into (about size / 256 pointers), and then every
+     * chunk (and roster of course) is copied once, when it is changed while
+     * snapshot still exists. Taking snapshot waits only for calls changing
+     * college in place (assignments, activeness), not for queries or other
+     * snapshots. Queries on snapshot take no locks and see people, courses
+     * and rosters as they were when snapshot was taken.
+     * Objects of people and courses are shared, so their activeness and
+     * get_courses() are always current.
+     */
+    CollegeSnapshot snapshot() const;
+
+    // Version of college, increased by every change of it.
+    std::uint64_t get_version() const noexcept
+    {
+        return version.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Lazy versions of find<T> and find_courses. They return range that
+     * matches people (courses) only when it is consumed, so asking for
+     * "*" costs nothing until results are used, and count(), exists(),
+     * first_n() and page() stop as early as they can. Range keeps state of
+     * college from the moment of query (like snapshot does). People are
+     * visited in the same order as find<T> returns them - by surnames and
+     * then names. If name pattern has literal prefix (or trigram index
+     * narrows search down), people it can match are collected and sorted
+     * when query is made, only matching them is lazy.
+     */
+    template <IsAcademic T>
+    using people_query = CollegeQuery<people_scan<T>>;
+    using course_query = CollegeQuery<course_scan<>>;
+
+    template <IsAcademic T>
+    people_query<T> query(const std::string &name_pattern,
+                          const std::string &surname_pattern) const;
+
+    course_query query_courses(const std::string &pattern) const;
+
+    /**
+     * Functions save whole college (people with their roles and activeness,
+     * courses with activeness and assignments of people to courses) to
+     * compact binary file and load it back. save writes college as it was at
+     * the moment of call (the same way snapshot does), so college can be
+     * changed while file is written, and replaces old file only when new one
+     * is complete. load maps file into memory, checks its version and
+     * checksum, and builds our maps in order in which they are stored, so
+     * starting from big college is much faster than adding everyone one by
+     * one. Trigram index is not saved - it can be enabled after loading.
+     */
+    void save(const std::string &path) const;
+
+    static College load(const std::string &path,
+                        std::pmr::memory_resource *resource =
+                            std::pmr::get_default_resource());
+
+    // Formats of registrar dumps accepted by bulk_import.
+    enum class import_format { csv, json_lines };
+
+    struct import_options
+    {
+        import_format format = import_format::csv;
+        // Rows read and applied at once. Memory used by import depends on
+        // it, not on size of input.
+        std::size_t batch_size = 4096;
+        // At most that many errors are kept in report (all are counted).
+        std::size_t max_errors = 1000;
+    };
+
+    struct import_error
+    {
+        std::size_t line;
+        std::string message;
+    };
+
+    struct import_report
+    {
+        std::size_t rows = 0;
+        std::size_t imported = 0;
+        std::size_t failed = 0;
+        std::vector<import_error> errors;
+    };
+
+    /**
+     * Function imports courses, people and assignments from registrar dump
+     * with one row per line. Row has fields type, name, surname, course and
+     * active - in CSV in this order (fields can be quoted, trailing empty
+     * ones can be skipped and header is ignored if it is the first
+     * non-empty line), in JSON-lines as keys of flat object. Types are
+     * course (uses course and active), student, teacher, phd_student (name,
+     * surname and active) and attends, handles (name, surname and course).
+     * Active defaults to true.
+     * Input is read in batches, so memory doesn't grow with its size. Every
+     * batch is applied under one lock: courses first, then people, then
+     * assignments, each sorted, so that one lookup finds both duplicate and
+     * place for new element (and sorted dump is appended at the ends of our
+     * maps). Rows breaking rules of add_course, add_person and assign_course
+     * or of the format are skipped and reported with their line numbers -
+     * they don't stop the import.
+     */
+    import_report bulk_import(std::istream &in,
+                              const import_options &options);
+
+    import_report bulk_import(std::istream &in)
+    {
+        return bulk_import(in, import_options());
+    }
+
+    struct log_options
+    {
+        // Log is written that long after first change waiting for it, so
+        // that more changes share one sync. With zero, changes made while
+        // previous sync runs share the next one.
+        std::chrono::microseconds commit_delay{0};
+        // Log is compacted into college file (in background) when it grows
+        // past that many bytes, 0 means only by compact_log().
+        std::uint64_t compact_size = 64 << 20;
+    };
+
+    /**
+     * Function makes college durable - it takes contents of college file
+     * at given path together with log of later changes (path + ".log"),
+     * and from now on appends every change (adding and removing courses
+     * and people, assignments, activeness, batches and imports) to that
+     * log. If there is no college file yet, current contents of college
+     * are written to it, otherwise they are replaced by contents of file
+     * and its log (trigram index stays enabled, if it was). Changing call
+     * returns only when its records are synced to disk, but calls waiting
+     * at the same time share one sync (group commit), so many threads pay
+     * for few syncs. Log is replayed directly into our maps, without
+     * checks and locks, and part of it torn by crash is cut off. When log
+     * grows (see log_options) or on compact_log(), next changes go to new
+     * log, and college as it was at that moment is written to college file
+     * by another thread, so nobody waits for it (new log is created before
+     * college is locked). If log or college file can't be written, call
+     * waiting for it (and every later change) throws - its change is done
+     * in memory, but it may be lost. Assigning other college to logged one
+     * compacts log, so college file gets assigned contents.
+     */
+    void open_log(const std::string &path, const log_options &options);
+
+    void open_log(const std::string &path)
+    {
+        open_log(path, log_options());
+    }
+
+    // Function starts compaction of log now, unless log isn't open or
+    // its compaction already runs. It doesn't wait for it. Next file of log
+    // is prepared before structure of college is locked, under the lock
+    // only state of college is taken.
+    void compact_log()
+    {
+        std::shared_ptr<mutation_log> log;
+        {
+            std::shared_lock lock(locks.structure);
+            log = logging.log;
+        }
+
+        if (log != nullptr && log->prepare_compaction(false))
+        {
+            std::unique_lock lock(locks.structure);
+            start_compaction(log);
+        }
+    }
+
+    // Function writes rest of log, waits for compaction and stops logging.
+    // It throws if any of them failed.
+    void close_log()
+    {
+        std::shared_ptr<mutation_log> log;
+        {
+            std::unique_lock lock(locks.structure);
+            log = std::move(logging.log);
+        }
+
+        if (log != nullptr)
+            log->close();
+    }
+
+private:
+    friend class CollegeSnapshot;
+
+    // Tests (college_stress_test.cpp, college_matcher_test.cpp) look at
+    // private parts of college through it.
+    friend struct CollegeTestAccess;
+
+    template <typename Scan>
+    friend class CollegeQuery;
+
+    // Name of person from pool of college (see name_pool).
+    using pooled_name = std::shared_ptr<const std::string>;
+
+    // Person stored together with pointers to its role subobjects, filled
+    // when person is added (we know its exact type then). Thanks to them
+    // queries don't need dynamic_pointer_cast through virtual inheritance -
+    // pointer is null if person does not have given role.
+    struct person_entry
+    {
+        std::shared_ptr<Person> person;
+        Student *student = nullptr;
+        Teacher *teacher = nullptr;
+        PhDStudent *phd_student = nullptr;
+        // Numbers of courses person attends and handles in this college,
+        // kept with its entries of assignment index, so that counting them
+        // doesn't walk the index. Changed under lock of person's shard.
+        std::size_t attends = 0;
+        std::size_t handles = 0;
+        // Keys of person in indexes view this string instead of name stored
+        // in person, so that they are shared by people of the same name.
+        pooled_name name;
+
+        template <IsAcademic T>
+        T *get() const noexcept
+        {
+            if constexpr (std::same_as<T, Person>)
+                return person.get();
+            else if constexpr (std::same_as<T, Student>)
+                return student;
+            else if constexpr (std::same_as<T, Teacher>)
+                return teacher;
+            else
+                return phd_student;
+        }
+
+        template <IsAcademic T>
+        bool has_role() const noexcept
+        {
+            return get<T>() != nullptr;
+        }
+
+        // Aliasing constructor shares ownership with person, so returned
+        // pointer is equivalent to the one we would get from a cast - empty
+        // if person does not have given role.
+        template <IsAcademic T>
+        std::shared_ptr<T> as() const noexcept
+        {
+            T *role = get<T>();
+            if (role == nullptr)
+                return std::shared_ptr<T>();
+            return std::shared_ptr<T>(person, role);
+        }
+
+        template <StudentTeacher T>
+        std::size_t courses() const noexcept
+        {
+            return std::same_as<T, Student> ? attends : handles;
+        }
+
+        template <StudentTeacher T>
+        std::size_t &courses() noexcept
+        {
+            if constexpr (std::same_as<T, Student>)
+                return attends;
+            else
+                return handles;
+        }
+
+        // Entry left in slab of ids by removed person.
+        bool empty() const noexcept
+        {
+            return person == nullptr;
+        }
+    };
+
+    // Person made by make_person, not yet added to college.
+    template <IsAcademic T>
+    struct new_person
+    {
+        std::shared_ptr<T> person;
+        pooled_name name;
+    };
+
+    // Person - identified by name and surname (they are unique). Key is a
+    // pair of views of pooled name (see person_entry) and surname stored in
+    // the person itself, so we don't keep second copy of them. It is
+    // ordered by name and then surname, so find<T> can visit only people
+    // whose names start with literal prefix of given pattern.
+    using person_key = std::pair<std::string_view, std::string_view>;
+
+    // The same order as of pairs, but keys of people in college view pooled
+    // names, so when both keys view the same string we know names are
+    // equal without comparing them.
+    struct person_key_less
+    {
+        bool operator()(const person_key &a, const person_key &b) const noexcept
+        {
+            if (a.first.data() != b.first.data() ||
+                a.first.size() != b.first.size())
+            {
+                if (int cmp = a.first.compare(b.first); cmp != 0)
+                    return cmp < 0;
+            }
+            return a.second < b.second;
+        }
+    };
+
+    // People are found by their keys, map gives their ids (see slabs in
+    // college_state).
+    using people_map = ChunkedMap<person_key, person_id, person_key_less>;
+
+    // People attending and handling given course, already ordered the way
+    // find<Student>(course) and find<Teacher>(course) return them, so we
+    // don't have to scan all people to answer such query.
+    using roster_set =
+        std::pmr::set<std::shared_ptr<Person>, Person::people_cmp>;
+
+    struct course_roster
+    {
+        roster_set students;
+        roster_set teachers;
+
+        explicit course_roster(std::pmr::memory_resource *resource) :
+            students(resource), teachers(resource) {}
+
+        // Copy stays in memory resource of original.
+        course_roster(const course_roster &other) :
+            students(other.students, other.students.get_allocator()),
+            teachers(other.teachers, other.teachers.get_allocator()) {}
+
+        template <StudentTeacher T>
+        const auto &members() const noexcept
+        {
+            if constexpr (std::same_as<T, Student>)
+                return students;
+            else
+                return teachers;
+        }
+
+        template <StudentTeacher T>
+        roster_set &members() noexcept
+        {
+            if constexpr (std::same_as<T, Student>)
+                return students;
+            else
+                return teachers;
+        }
+    };
+
+    struct course_entry
+    {
+        std::shared_ptr<Course> course;
+        // Roster can be shared with states kept by snapshots, it is copied
+        // when it is changed (see college_state::unshared_roster).
+        CowPtr<course_roster> roster;
+
+        // Entry left in slab of ids by removed course.
+        bool empty() const noexcept
+        {
+            return course == nullptr;
+        }
+    };
+
+    // Course - identified by its name (name is unique). Key is a view of
+    // name stored in the course, map gives its id. Map is sorted by names,
+    // so we can quickly find course by its name or name prefix.
+    using course_map = ChunkedMap<std::string_view, course_id>;
+
+    // Optional trigram indexes for patterns without literal prefix.
+    // People and courses are indexed by their keys (views of names stored in
+    // persons and courses), which stay valid when state is copied and are
+    // ordered the same way as our maps.
+    struct ngram_indexes
+    {
+        NgramIndex<person_key> name_ngrams;
+        NgramIndex<person_key> surname_ngrams;
+        NgramIndex<std::string_view> course_ngrams;
+        // Kept, so that index can be built again for other contents.
+        std::size_t max_posting_size;
+
+        explicit ngram_indexes(std::size_t _max_posting_size) :
+            name_ngrams(_max_posting_size), surname_ngrams(_max_posting_size),
+            course_ngrams(_max_posting_size),
+            max_posting_size(_max_posting_size) {}
+
+        void insert_person(const person_key &key)
+        {
+            name_ngrams.insert(std::string(key.first), key);
+            surname_ngrams.insert(std::string(key.second), key);
+        }
+
+        void insert_course(const std::shared_ptr<Course> &course)
+        {
+            course_ngrams.insert(course->get_name(), course->get_name());
+        }
+    };
+
+    /**
+     * Threads running wide scans in parallel (see set_parallel_scan). Scan
+     * is split into chunks, which are taken one by one by workers and by
+     * thread that runs the scan, so it does its share of work too and
+     * returns once every chunk is done. Pool runs one scan at a time - if it
+     * is busy, other scans go on their calling threads instead of waiting.
+     */
+    class scan_pool
+    {
+    public:
+        explicit scan_pool(std::size_t workers)
+        {
+            for (std::size_t i = 0; i < workers; i++)
+                threads.emplace_back([this]() { work(); });
+        }
+
+        scan_pool(const scan_pool &) = delete;
+        scan_pool &operator=(const scan_pool &) = delete;
+
+        ~scan_pool()
+        {
+            {
+                std::lock_guard lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+
+            for (auto &thread : threads)
+                thread.join();
+        }
+
+        // Number of chunks scan of given size is split into. A few chunks
+        // per thread, so threads that got cheaper chunks take more of them.
+        std::size_t chunks(std::size_t scan_size) const noexcept
+        {
+            return std::min(scan_size, (threads.size() + 1) * 4);
+        }
+
+        // Function calls f(chunk) for every chunk in [0, count), and
+        // rethrows the first exception thrown by any of these calls.
+        void run(std::size_t count, const std::function<void(std::size_t)> &f)
+        {
+            std::unique_lock busy_lock(busy, std::try_to_lock);
+            if (!busy_lock.owns_lock())
+            {
+                for (std::size_t chunk = 0; chunk < count; chunk++)
+                    f(chunk);
+                return;
+            }
+
+            {
+                std::lock_guard lock(mutex);
+                job = &f;
+                job_size = count;
+                next_chunk.store(0, std::memory_order_relaxed);
+                generation++;
+            }
+            wake.notify_all();
+
+            take_chunks(f, count);
+
+            // All chunks are taken, so we wait only for workers still
+            // running theirs. Workers that didn't join yet won't join once
+            // job is cleared.
+            std::unique_lock lock(mutex);
+            done.wait(lock, [this]() { return joined == 0; });
+            job = nullptr;
+
+            if (error != nullptr)
+                std::rethrow_exception(std::exchange(error, nullptr));
+        }
+
+    private:
+        std::vector<std::thread> threads;
+        std::mutex busy;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        bool stopping = false;
+        // Current job (null if there is none), guarded by mutex.
+        const std::function<void(std::size_t)> *job = nullptr;
+        std::size_t job_size = 0;
+        std::uint64_t generation = 0;
+        std::size_t joined = 0;
+        std::exception_ptr error;
+        std::atomic<std::size_t> next_chunk = 0;
+
+        void work()
+        {
+            std::uint64_t seen = 0;
+            std::unique_lock lock(mutex);
+
+            while (true)
+            {
+                wake.wait(lock, [&]()
+                {
+                    return stopping || (job != nullptr && generation != seen);
+                });
+                if (stopping)
+                    return;
+
+                seen = generation;
+                const auto &f = *job;
+                std::size_t count = job_size;
+                joined++;
+
+                lock.unlock();
+                take_chunks(f, count);
+                lock.lock();
+
+                if (--joined == 0)
+                    done.notify_all();
+            }
+        }
+
+        void take_chunks(const std::function<void(std::size_t)> &f,
+                         std::size_t count)
+        {
+            for (std::size_t chunk;
+                 (chunk = next_chunk.fetch_add(1, std::memory_order_relaxed))
+                     < count;)
+            {
+                try
+                {
+                    f(chunk);
+                }
+                catch (...)
+                {
+                    std::lock_guard lock(mutex);
+                    if (error == nullptr)
+                        error = std::current_exception();
+                }
+            }
+        }
+    };
+
+    // Courses ordered by numbers of their students (the biggest first, then
+    // by names), so top_courses doesn't have to look at all of them. It is
+    // updated by everything that changes rosters of students, also under
+    // shared lock of structure, so it has its own mutex.
+    struct enrollment_index
+    {
+        using key = std::pair<std::size_t, const Course *>;
+
+        struct more_students
+        {
+            bool operator()(const key &a, const key &b) const noexcept
+            {
+                if (a.first != b.first)
+                    return a.first > b.first;
+                return a.second->get_name() < b.second->get_name();
+            }
+        };
+
+        mutable std::mutex mutex;
+        ChunkedSet<key, more_students> courses;
+
+        explicit enrollment_index(std::pmr::memory_resource *resource) :
+            courses(resource) {}
+
+        enrollment_index(const enrollment_index &other) :
+            courses(other.courses) {}
+
+        enrollment_index &operator=(const enrollment_index &) = delete;
+
+        void insert(const Course *course, std::size_t students)
+        {
+            std::lock_guard lock(mutex);
+            courses.emplace(students, course);
+        }
+
+        void erase(const Course *course, std::size_t students)
+        {
+            std::lock_guard lock(mutex);
+            courses.erase(key(students, course));
+        }
+
+        void update(const Course *course, std::size_t before,
+                    std::size_t after)
+        {
+            if (before == after)
+                return;
+
+            std::lock_guard lock(mutex);
+            if (courses.erase(key(before, course)) != 0)
+                courses.emplace(after, course);
+        }
+    };
+
+    // Pairs (person, course) of students attending and teachers handling
+    // courses, ordered by people, so courses of person are found without
+    // its own sets of courses. Objects of people (and their sets) are
+    // shared with copies of college, while index belongs to state, so
+    // assignments and removals decide by it whether person has course in
+    // this college. It is changed under shared lock of structure, like
+    // enrollment_index, so it has its own mutex.
+    struct assignment_index
+    {
+        using key = std::pair<person_id, course_id>;
+
+        mutable std::mutex mutex;
+        ChunkedSet<key> students;
+        ChunkedSet<key> teachers;
+
+        explicit assignment_index(std::pmr::memory_resource *resource) :
+            students(resource), teachers(resource) {}
+
+        assignment_index(const assignment_index &other) :
+            students(other.students), teachers(other.teachers) {}
+
+        assignment_index &operator=(const assignment_index &) = delete;
+
+        // Both return false if nothing changed.
+        template <StudentTeacher T>
+        bool insert(person_id person, course_id course)
+        {
+            std::lock_guard lock(mutex);
+            return pairs<T>().emplace(person, course).second;
+        }
+
+        template <StudentTeacher T>
+        bool erase(person_id person, course_id course)
+        {
+            std::lock_guard lock(mutex);
+            return pairs<T>().erase(key(person, course)) != 0;
+        }
+
+        // Function removes all courses of person and returns them.
+        template <StudentTeacher T>
+        std::vector<course_id> take(person_id person)
+        {
+            std::lock_guard lock(mutex);
+            auto &all = pairs<T>();
+            std::vector<course_id> courses;
+            for (auto iter = all.lower_bound(key(person, 0));
+                 iter != all.end() && iter->first == person;
+                 iter = all.lower_bound(key(person, 0)))
+            {
+                courses.push_back(iter->second);
+                all.erase(iter);
+            }
+            return courses;
+        }
+
+    private:
+        template <StudentTeacher T>
+        ChunkedSet<key> &pairs() noexcept
+        {
+            if constexpr (std::same_as<T, Student>)
+                return students;
+            else
+                return teachers;
+        }
+
+        template <StudentTeacher T>
+        const ChunkedSet<key> &pairs() const noexcept
+        {
+            if constexpr (std::same_as<T, Student>)
+                return students;
+            else
+                return teachers;
+        }
+    };
+
+    // Element of index of people ordered by surnames. View of surname is
+    // kept next to person, so walking the index doesn't visit people whose
+    // surnames don't match. Entry of person is found by its id.
+    struct surname_key
+    {
+        std::string_view surname;
+        const Person *person;
+    };
+
+    // Order of results of find<T> - by surnames, then names. Keys can also
+    // be compared with surnames alone, so index of people ordered this way
+    // can be searched by surname prefix.
+    struct surname_less
+    {
+        using is_transparent = void;
+
+        bool operator()(const Person *a, const Person *b) const noexcept
+        {
+            if (a->surname != b->surname)
+                return a->surname < b->surname;
+            return a->name < b->name;
+        }
+
+        bool operator()(const person_entry *a,
+                        const person_entry *b) const noexcept
+        {
+            return (*this)(a->person.get(), b->person.get());
+        }
+
+        bool operator()(const surname_key &a,
+                        const surname_key &b) const noexcept
+        {
+            if (a.surname != b.surname)
+                return a.surname < b.surname;
+            return a.person->name < b.person->name;
+        }
+
+        bool operator()(const surname_key &a,
+                        std::string_view surname) const noexcept
+        {
+            return a.surname < surname;
+        }
+
+        bool operator()(std::string_view surname,
+                        const surname_key &b) const noexcept
+        {
+            return surname < b.surname;
+        }
+
+        // Key of person (name and surname), see people_scan::start.
+        bool operator()(const person_key &a,
+                        const surname_key &b) const noexcept
+        {
+            if (a.second != b.surname)
+                return a.second < b.surname;
+            return a.first < b.person->name;
+        }
+    };
+
+    using surname_index = ChunkedSet<surname_key, surname_less>;
+
+    /**
+     * Everything that makes up one version of our college. Queries are
+     * implemented here, so they can be run both on current state of college
+     * (under lock) and on state kept by a snapshot (without any lock). All
+     * containers are chunked (see ChunkedSet), so copy of state shares them
+     * with original and costs O(size / chunk) - every change later copies
+     * only chunks it touches.
+     */
+    struct college_state
+    {
+        people_map people_names;
+        course_map course_names;
+        // Null if trigram index is disabled. Shared between copies of state
+        // until one of them changes it.
+        CowPtr<ngram_indexes> ngrams;
+        // Slabs of ids: entry of person (course) of given id, empty if it
+        // was removed. Id is also remembered in person (course) itself.
+        // Ids of removed ones wait in free lists for the next added, so
+        // slabs (and scans over them) don't grow with churn.
+        ChunkedVector<person_entry> people_by_id;
+        ChunkedVector<course_entry> courses_by_id;
+        ChunkedVector<person_id> free_person_ids;
+        ChunkedVector<course_id> free_course_ids;
+        // The same people ordered by surnames and names, so find<T> gets
+        // them already in order of its results.
+        surname_index people_surnames;
+        // Courses of people in this state (see assignment_index).
+        assignment_index assignments;
+        // Aggregates (see College::count_active_students). Activeness
+        // changes under shared lock of structure, so counters are atomic.
+        enrollment_index enrollment;
+        std::atomic<std::size_t> active_students = 0;
+        std::atomic<std::size_t> active_courses = 0;
+
+        // Everything state creates comes from given memory resource.
+        explicit college_state(std::pmr::memory_resource *resource) :
+            people_names(resource), course_names(resource),
+            people_by_id(resource), courses_by_id(resource),
+            free_person_ids(resource), free_course_ids(resource),
+            people_surnames(resource), assignments(resource),
+            enrollment(resource) {}
+
+        // Copy shares chunks of all containers with original (and uses its
+        // memory resource).
+        college_state(const college_state &other) :
+            people_names(other.people_names),
+            course_names(other.course_names), ngrams(other.ngrams),
+            people_by_id(other.people_by_id),
+            courses_by_id(other.courses_by_id),
+            free_person_ids(other.free_person_ids),
+            free_course_ids(other.free_course_ids),
+            people_surnames(other.people_surnames),
+            assignments(other.assignments), enrollment(other.enrollment),
+            active_students(other.active_students.load()),
+            active_courses(other.active_courses.load()) {}
+
+        college_state &operator=(const college_state &) = delete;
+
+        std::pmr::memory_resource *memory() const noexcept
+        {
+            return people_names.resource();
+        }
+
+        const person_entry *person_at(person_id id) const noexcept
+        {
+            if (id >= people_by_id.size() || people_by_id[id].empty())
+                return nullptr;
+            return &people_by_id[id];
+        }
+
+        const course_entry *course_at(course_id id) const noexcept
+        {
+            if (id >= courses_by_id.size() || courses_by_id[id].empty())
+                return nullptr;
+            return &courses_by_id[id];
+        }
+
+        // Functions find entries of given person and course by their ids.
+        // We also have to compare pointers - person or course can belong to
+        // other college, where it got the same id.
+        const person_entry *find_person(const Person *person) const noexcept
+        {
+            if (person == nullptr)
+                return nullptr;
+
+            auto entry = person_at(person->id);
+            return entry != nullptr && entry->person.get() == person ?
+                entry : nullptr;
+        }
+
+        const course_entry *find_course(const Course *course) const noexcept
+        {
+            if (course == nullptr)
+                return nullptr;
+
+            auto entry = course_at(course->id);
+            return entry != nullptr && entry->course.get() == course ?
+                entry : nullptr;
+        }
+
+        bool has_person(const std::shared_ptr<Person> &person) const noexcept
+        {
+            return find_person(person.get()) != nullptr;
+        }
+
+        bool has_course(const std::shared_ptr<Course> &course) const noexcept
+        {
+            return find_course(course.get()) != nullptr;
+        }
+
+        // True if entry of given course can be changed in place, without
+        // copying chunk of slab it is in (ids out of slab don't need it).
+        bool course_unshared(course_id id) const noexcept
+        {
+            return id >= courses_by_id.size() || courses_by_id.unique(id);
+        }
+
+        void unshare_course(course_id id)
+        {
+            if (id < courses_by_id.size())
+                courses_by_id.unshared(id);
+        }
+
+        // The same for entry of person.
+        bool person_unshared(person_id id) const noexcept
+        {
+            return id >= people_by_id.size() || people_by_id.unique(id);
+        }
+
+        void unshare_person(person_id id)
+        {
+            if (id < people_by_id.size())
+                people_by_id.unshared(id);
+        }
+
+        // Functions below change state, so it can't be shared with any
+        // snapshot when they are called.
+        // Roster of given course that can be changed in place - copy of it
+        // (and of chunk of slab with its entry), if they are shared with
+        // other state. Entry stays where it was if chunk wasn't shared, so
+        // it can be called under shared lock of structure (and lock of
+        // course's shard), once College::lock_unshared_state made it so.
+        course_roster &unshared_roster(course_id id)
+        {
+            return courses_by_id.unshared(id).roster.unshared();
+        }
+
+        // Functions add and remove pair (person, course) in assignment index
+        // and update number of courses in entry of person. They return false
+        // if nothing changed. Entry is changed in place the same way as by
+        // unshared_roster, so pointers to entries of people taken earlier
+        // stay valid only if its chunk wasn't shared.
+        template <StudentTeacher T>
+        bool add_assignment(person_id person, course_id course)
+        {
+            if (!assignments.template insert<T>(person, course))
+                return false;
+            people_by_id.unshared(person).template courses<T>()++;
+            return true;
+        }
+
+        template <StudentTeacher T>
+        bool remove_assignment(person_id person, course_id course)
+        {
+            if (!assignments.template erase<T>(person, course))
+                return false;
+            people_by_id.unshared(person).template courses<T>()--;
+            return true;
+        }
+
+        // Hint is used when courses are added in order of their names
+        // (loading college from file), so every insertion takes constant
+        // time.
+        course_id add_course(const std::shared_ptr<Course> &course,
+                             course_map::const_iterator hint)
+        {
+            check_free_id(courses_by_id, free_course_ids);
+
+            auto roster = CowPtr<course_roster>::make(memory(), memory());
+            course->id = take_id(courses_by_id, free_course_ids,
+                                 course_entry{course, std::move(roster)});
+
+            // Key is a view of name stored in course itself.
+            course_names.emplace_hint(hint, course->get_name(), course->id);
+            if (ngrams)
+                unshared_ngrams().insert_course(course);
+
+            enrollment.insert(course.get(), 0);
+            if (course->is_active())
+                active_courses++;
+
+            return course->id;
+        }
+
+        course_id add_course(const std::shared_ptr<Course> &course)
+        {
+            return add_course(course, course_names.end());
+        }
+
+        // Course is also removed from courses of its students and teachers,
+        // found in its roster, so removal costs O(number of them) and not
+        // O(size of college).
+        void remove_course(course_id id)
+        {
+            // Entry is emptied at the end, so we keep our own pointers.
+            auto course = courses_by_id[id].course;
+            auto roster = courses_by_id[id].roster;
+
+            for (const auto &member : roster->students)
+                unlink_member<Student>(member.get(), course);
+            for (const auto &member : roster->teachers)
+                unlink_member<Teacher>(member.get(), course);
+
+            enrollment.erase(course.get(), roster->students.size());
+            if (course->is_active())
+                active_courses--;
+
+            if (ngrams)
+                unshared_ngrams().course_ngrams.erase(course->get_name(),
+                                                      course->get_name());
+            course_names.erase(std::string_view(course->get_name()));
+            courses_by_id.unshared(id) = course_entry();
+            free_course_ids.push_back(id);
+        }
+
+        // Function removes person together with its assignments. Its
+        // courses are taken from assignment index of this state, and
+        // unlinked from both sides one by one, so it costs O(number of
+        // courses of person).
+        void remove_person(person_id id)
+        {
+            const person_entry entry = people_by_id[id];
+            const person_key key(entry.person->get_name(),
+                                 entry.person->get_surname());
+
+            if (entry.student != nullptr)
+            {
+                for (course_id course : assignments.take<Student>(id))
+                {
+                    auto found = course_at(course);
+                    if (found == nullptr)
+                        continue;
+                    // Chunk of found entry may be replaced by its copy below.
+                    const auto course_ptr = found->course;
+
+                    auto &students = unshared_roster(course).students;
+                    std::size_t before = students.size();
+                    students.erase(entry.person);
+                    students_changed(courses_by_id[course], before);
+                    unlink(entry.student->subjects_I_attend, course_ptr);
+                }
+
+                if (entry.student->is_active())
+                    active_students--;
+            }
+
+            if (entry.teacher != nullptr)
+            {
+                for (course_id course : assignments.take<Teacher>(id))
+                {
+                    auto found = course_at(course);
+                    if (found == nullptr)
+                        continue;
+                    const auto course_ptr = found->course;
+
+                    unshared_roster(course).teachers.erase(entry.person);
+                    unlink(entry.teacher->subjects_I_handle, course_ptr);
+                }
+            }
+
+            people_surnames.erase(surname_key{key.second,
+                                              entry.person.get()});
+            if (ngrams)
+            {
+                auto &indexes = unshared_ngrams();
+                indexes.name_ngrams.erase(std::string(key.first), key);
+                indexes.surname_ngrams.erase(std::string(key.second), key);
+            }
+            people_names.erase(key);
+            people_by_id.unshared(id) = person_entry();
+            free_person_ids.push_back(id);
+        }
+
+        // Function removes course from courses of member of its roster (in
+        // assignment index and in member's own set of courses).
+        template <StudentTeacher T>
+        void unlink_member(const Person *member,
+                           const std::shared_ptr<Course> &course)
+        {
+            auto entry = find_person(member);
+            if (entry == nullptr || entry->get<T>() == nullptr)
+                return;
+
+            if constexpr (std::same_as<T, Student>)
+                unlink(entry->student->subjects_I_attend, course);
+            else
+                unlink(entry->teacher->subjects_I_handle, course);
+            // Last, it can move entry of person.
+            remove_assignment<T>(member->id, course->id);
+        }
+
+        // Function removes course from set of courses of person, if it is
+        // there (set can have other course of the same name only if person
+        // is shared with copy of college).
+        template <typename Courses>
+        static void unlink(Courses &courses,
+                           const std::shared_ptr<Course> &course) noexcept
+        {
+            auto iter = courses.find(course);
+            if (iter != courses.end() && *iter == course)
+                courses.erase(iter);
+        }
+
+        // Function moves course in enrollment index after number of its
+        // students changed from given one (rosters are changed directly).
+        void students_changed(const course_entry &entry, std::size_t before)
+        {
+            enrollment.update(entry.course.get(), before,
+                              entry.roster->students.size());
+        }
+
+        // Function adds newly created person of type T to our containers.
+        // Hint works the same way as in add_course.
+        template <IsAcademic T>
+        person_id add_person(const new_person<T> &added,
+                             people_map::const_iterator hint)
+        {
+            check_free_id(people_by_id, free_person_ids);
+
+            const std::shared_ptr<T> &person = added.person;
+            person_entry entry;
+            entry.person = person;
+            entry.name = added.name;
+            if constexpr (std::derived_from<T, Student>)
+                entry.student = person.get();
+            if constexpr (std::derived_from<T, Teacher>)
+                entry.teacher = person.get();
+            if constexpr (std::same_as<T, PhDStudent>)
+                entry.phd_student = person.get();
+
+            const Student *student = entry.student;
+            person->id = take_id(people_by_id, free_person_ids,
+                                 std::move(entry));
+
+            const person_key key(*added.name, person->get_surname());
+            people_names.emplace_hint(hint, key, person->id);
+            people_surnames.emplace(key.second, person.get());
+            if (ngrams)
+                unshared_ngrams().insert_person(key);
+
+            if (student != nullptr && student->is_active())
+                active_students++;
+
+            return person->id;
+        }
+
+        template <IsAcademic T>
+        person_id add_person(const new_person<T> &added)
+        {
+            return add_person(added, people_names.end());
+        }
+
+        // Function throws when all 2^32 ids are taken, before anything is
+        // changed.
+        template <typename Slab, typename Free>
+        static void check_free_id(const Slab &slab, const Free &free)
+        {
+            if (free.empty() && slab.size() > UINT32_MAX)
+                throw too_many_ids_exception();
+        }
+
+        // Function puts entry of newly added person (course) in slab and
+        // returns its id - recently freed one if there is any.
+        template <typename Entry, typename Free>
+        static std::uint32_t take_id(ChunkedVector<Entry> &slab, Free &free,
+                                     Entry entry)
+        {
+            if (free.empty())
+            {
+                slab.push_back(std::move(entry));
+                return static_cast<std::uint32_t>(slab.size() - 1);
+            }
+
+            std::uint32_t id = free.back();
+            slab.unshared(id) = std::move(entry);
+            free.pop_back();
+            return id;
+        }
+
+        ngram_indexes &unshared_ngrams()
+        {
+            return ngrams.unshared();
+        }
+
+        // Function builds trigram indexes of everything in state.
+        void index_ngrams(std::size_t max_posting_size)
+        {
+            auto made = CowPtr<ngram_indexes>::make(
+                std::pmr::get_default_resource(), max_posting_size);
+            auto &indexes = made.unshared();
+            for (const auto &[key, id] : people_names)
+                indexes.insert_person(key);
+            for (const auto &[name, id] : course_names)
+                indexes.insert_course(courses_by_id[id].course);
+
+            ngrams = std::move(made);
+        }
+
+        // Function returns empty set for results of find_courses, using
+        // given memory resource. Sets are made here, so their type doesn't
+        // depend on matcher of query.
+        static auto course_set(std::pmr::memory_resource *resource)
+        {
+            // We need custom comparator for our set, since we want our
+            // courses in lexycographic order given by their names.
+            auto my_cmp = [](const std::shared_ptr<Course> &a, const std::shared_ptr<Course> &b)
+            {
+                return a->get_name() < b->get_name();
+            };
+
+            return std::set<std::shared_ptr<Course>, decltype(my_cmp),
+                            std::pmr::polymorphic_allocator<
+                                std::shared_ptr<Course>>>(resource);
+        }
+
+        // Queries below scan in parallel on given pool (if any) when they
+        // would have to check all people or courses anyway.
+        template <typename Matcher = runtime_matcher>
+        auto find_courses(std::string_view pattern,
+                          std::pmr::memory_resource *resource =
+                              std::pmr::get_default_resource(),
+                          scan_pool *pool = nullptr) const
+        {
+            // We need to make a new set, cause we can get many different
+            // patterns so each time we have to make new set of found elems
+            // and return it.
+            auto matching_courses = course_set(resource);
+
+            // Pattern without wildcards can match only course of exactly the
+            // same name, so one lookup is enough.
+            if (Matcher(pattern).exact())
+            {
+                auto iter = course_names.find(pattern);
+                if (iter != course_names.end())
+                    matching_courses.emplace(
+                        courses_by_id[iter->second].course);
+
+                return matching_courses;
+            }
+
+            // Scan visits courses in order of names, so every course can be
+            // inserted at the end of our set.
+            auto insert = [&](const course_entry &entry)
+            {
+                matching_courses.emplace_hint(matching_courses.end(),
+                                              entry.course);
+            };
+
+            course_scan<Matcher> scan(*this, pattern);
+            if (pool != nullptr && scan.full())
+                for (auto entry : parallel_find_courses<Matcher>(pattern, *pool))
+                    insert(*entry);
+            else
+                for_each_match(scan, insert);
+
+            return matching_courses;
+        }
+
+        // Function returns empty set for results of find<T>, the same way
+        // as course_set.
+        template <IsAcademic T>
+        static auto people_set(std::pmr::memory_resource *resource)
+        {
+            // Custom lexicographical comparator for our result set. Sorted by
+            // surname then name.
+
+            auto name_cmp = [](const std::shared_ptr<T> &a,
+                 const std::shared_ptr<T> &b)
+            {
+                if (a->get_surname() != b->get_surname())
+                    return a->get_surname() < b->get_surname();
+                else
+                    return a->get_name() < b->get_name();
+            };
+
+            return std::set<std::shared_ptr<T>, decltype(name_cmp),
+                            std::pmr::polymorphic_allocator<
+                                std::shared_ptr<T>>>(resource);
+        }
+
+        template <IsAcademic T, typename NameMatcher = runtime_matcher,
+                  typename SurnameMatcher = runtime_matcher>
+        auto find(std::string_view name_pattern,
+                  std::string_view surname_pattern,
+                  std::pmr::memory_resource *resource =
+                      std::pmr::get_default_resource(),
+                  scan_pool *pool = nullptr) const
+        {
+            // Result set. People come in its order, so each one is inserted
+            // at the end.
+            auto matching_people = people_set<T>(resource);
+
+            for_each_person<T, NameMatcher, SurnameMatcher>(
+                name_pattern, surname_pattern, pool,
+                [&](const person_entry &entry)
+                {
+                    matching_people.emplace_hint(matching_people.end(),
+                                                 entry.template as<T>());
+                });
+
+            return matching_people;
+        }
+
+        // Versions of find_courses and find<T> returning ids (see
+        // College::person_id).
+        std::vector<course_id> find_course_ids(std::string_view pattern,
+                                               scan_pool *pool = nullptr) const
+        {
+            std::vector<course_id> ids;
+
+            if (!has_wildcards(pattern))
+            {
+                auto iter = course_names.find(pattern);
+                if (iter != course_names.end())
+                    ids.push_back(iter->second);
+                return ids;
+            }
+
+            course_scan<> scan(*this, pattern);
+            if (pool != nullptr && scan.full())
+            {
+                for (auto entry : parallel_find_courses<>(pattern, *pool))
+                    ids.push_back(entry->course->id);
+                return ids;
+            }
+
+            for_each_match(scan, [&](const course_entry &entry)
+                                 {
+                                     ids.push_back(entry.course->id);
+                                 });
+            return ids;
+        }
+
+        template <IsAcademic T>
+        std::vector<person_id> find_ids(std::string_view name_pattern,
+                                        std::string_view surname_pattern,
+                                        scan_pool *pool = nullptr) const
+        {
+            std::vector<person_id> ids;
+
+            for_each_person<T>(name_pattern, surname_pattern, pool,
+                               [&](const person_entry &entry)
+                               {
+                                   ids.push_back(entry.person->id);
+                               });
+            return ids;
+        }
+
+        // Function calls f for every person of type T matching patterns, in
+        // order of results of find<T> (see people_scan). Full walk is split
+        // between threads if there is a pool for it.
+        template <IsAcademic T, typename NameMatcher = runtime_matcher,
+                  typename SurnameMatcher = runtime_matcher, typename F>
+        void for_each_person(std::string_view name_pattern,
+                             std::string_view surname_pattern,
+                             scan_pool *pool, F &&f) const
+        {
+            people_scan<T, NameMatcher, SurnameMatcher> scan(
+                *this, name_pattern, surname_pattern);
+
+            if (scan.full() && pool != nullptr)
+            {
+                for (auto entry : parallel_find<T, NameMatcher,
+                         SurnameMatcher>(name_pattern, surname_pattern, *pool))
+                    f(*entry);
+            }
+            else
+                for_each_match(scan, f);
+        }
+
+        // Parallel versions of full scans. Slab of ids is split into chunks,
+        // every chunk is matched and sorted by one thread of pool, and then
+        // sorted chunks are merged (also on pool). Entries are returned in
+        // order of results of find<T> (find_courses). Work of patterns
+        // isn't counted in metrics - workers don't know measured call.
+        template <IsAcademic T, typename NameMatcher = runtime_matcher,
+                  typename SurnameMatcher = runtime_matcher>
+        std::vector<const person_entry *> parallel_find(
+            std::string_view name_pattern, std::string_view surname_pattern,
+            scan_pool &pool) const
+        {
+            const NameMatcher name_matcher(name_pattern);
+            const SurnameMatcher surname_matcher(surname_pattern);
+
+            return parallel_scan(people_by_id, pool,
+                [&](const person_entry &entry)
+                {
+                    return entry.has_role<T>() &&
+                        name_matcher.template matches<false>(
+                            entry.person->name) &&
+                        surname_matcher.template matches<false>(
+                            entry.person->surname);
+                },
+                surname_less());
+        }
+
+        template <typename Matcher = runtime_matcher>
+        std::vector<const course_entry *> parallel_find_courses(
+            std::string_view pattern, scan_pool &pool) const
+        {
+            const Matcher matcher(pattern);
+
+            return parallel_scan(courses_by_id, pool,
+                [&](const course_entry &entry)
+                {
+                    return matcher.template matches<false>(
+                        entry.course->get_name());
+                },
+                [](const course_entry *a, const course_entry *b)
+                {
+                    return a->course->get_name() < b->course->get_name();
+                });
+        }
+
+        template <typename Entry, typename Matches, typename Order>
+        static std::vector<const Entry *> parallel_scan(
+            const ChunkedVector<Entry> &slab, scan_pool &pool,
+            const Matches &matches, const Order &order)
+        {
+            std::size_t chunks = pool.chunks(slab.size());
+            std::vector<std::vector<const Entry *>> found(chunks);
+
+            pool.run(chunks, [&](std::size_t chunk)
+            {
+                auto &entries = found[chunk];
+                for (std::size_t id = slab.size() * chunk / chunks;
+                     id < slab.size() * (chunk + 1) / chunks; id++)
+                {
+                    // Slab has empty entries in place of removed ones.
+                    if (!slab[id].empty() && matches(slab[id]))
+                        entries.push_back(&slab[id]);
+                }
+                std::sort(entries.begin(), entries.end(), order);
+            });
+
+            // Sorted chunks are concatenated and then merged pairwise, with
+            // merges of one round running in parallel.
+            std::vector<const Entry *> result;
+            std::vector<std::size_t> bounds{0};
+            for (const auto &entries : found)
+            {
+                result.insert(result.end(), entries.begin(), entries.end());
+                bounds.push_back(result.size());
+            }
+
+            for (std::size_t width = 1; width < chunks; width *= 2)
+            {
+                std::size_t merges = (chunks + width - 1) / (2 * width);
+                pool.run(merges, [&](std::size_t merge)
+                {
+                    std::size_t first = 2 * width * merge;
+                    std::inplace_merge(
+                        result.begin() + bounds[first],
+                        result.begin() + bounds[first + width],
+                        result.begin() + bounds[std::min(first + 2 * width,
+                                                         chunks)],
+                        order);
+                });
+            }
+
+            return result;
+        }
+
+        // Function calls f for every entry matched by scan. Matcher counts
+        // its work only when metrics are enabled - we decide it once per
+        // scan, so the usual loop doesn't pay for counters.
+        template <typename Scan, typename F>
+        static void for_each_match(const Scan &scan, F &&f)
+        {
+            if (current_pattern_work != nullptr)
+            {
+                for (auto pos = scan.start();
+                     auto entry = scan.template match<true>(pos);
+                     scan.advance(pos))
+                    f(*entry);
+            }
+            else
+            {
+                for (auto pos = scan.start();
+                     auto entry = scan.template match<false>(pos);
+                     scan.advance(pos))
+                    f(*entry);
+            }
+        }
+
+        // Function returns roster of given course, or nullptr if course
+        // is not in this state.
+        const course_roster *find_roster(
+            const std::shared_ptr<Course> &course) const noexcept
+        {
+            auto entry = find_course(course.get());
+            return entry == nullptr ? nullptr : &*entry->roster;
+        }
+
+        std::vector<course_enrollment> top_courses(std::size_t k) const
+        {
+            std::lock_guard lock(enrollment.mutex);
+
+            std::vector<course_enrollment> top;
+            top.reserve(std::min(k, enrollment.courses.size()));
+            for (const auto &[students, course] : enrollment.courses)
+            {
+                if (top.size() == k)
+                    break;
+                top.push_back({course_at(course->id)->course, students});
+            }
+            return top;
+        }
+    };
+
+    // How pattern has to be checked: every string matches it, only one does,
+    // string has to start or end with literal part of pattern, or we need
+    // the whole wildcard matcher.
+    enum class pattern_kind
+    {
+        any, exact, prefix, suffix, general
+    };
+
+    // Compile-time helpers walk patterns by hand, since string_view::find
+    // can't be used on template arguments by some compilers.
+    static constexpr pattern_kind classify(std::string_view pattern) noexcept
+    {
+        std::size_t stars = 0, first_star = pattern.size(), last_star = 0;
+
+        for (std::size_t i = 0; i < pattern.size(); i++)
+        {
+            if (pattern[i] == '?')
+                return pattern_kind::general;
+            if (pattern[i] == '*')
+            {
+                stars++;
+                first_star = std::min(first_star, i);
+                last_star = i;
+            }
+        }
+
+        if (!pattern.empty() && stars == pattern.size())
+            return pattern_kind::any;
+        if (stars == 0)
+            return pattern_kind::exact;
+        // All stars at the end or all at the beginning.
+        if (stars == pattern.size() - first_star)
+            return pattern_kind::prefix;
+        if (stars == last_star + 1)
+            return pattern_kind::suffix;
+        return pattern_kind::general;
+    }
+
+    // Function returns pattern without its leading and trailing stars.
+    static constexpr std::string_view strip_stars(
+        std::string_view pattern) noexcept
+    {
+        while (!pattern.empty() && pattern.front() == '*')
+            pattern.remove_prefix(1);
+        while (!pattern.empty() && pattern.back() == '*')
+            pattern.remove_suffix(1);
+        return pattern;
+    }
+
+    // Matchers are used by scans to check single strings. This one matches
+    // pattern known only when query is made.
+    struct runtime_matcher
+    {
+        explicit runtime_matcher(std::string_view _pattern) noexcept :
+            pattern(_pattern) {}
+
+        bool exact() const noexcept
+        {
+            return !has_wildcards(pattern);
+        }
+
+        std::string_view prefix() const noexcept
+        {
+            return literal_prefix(pattern);
+        }
+
+        template <bool counted>
+        bool matches(std::string_view str) const noexcept
+        {
+            return satisfies_pattern<counted>(str, pattern);
+        }
+
+        std::string_view pattern;
+    };
+
+    // Matcher of pattern known at compile time (pattern given to scan is
+    // the same one, so it is ignored).
+    template <FixedPattern P>
+    struct static_matcher
+    {
+        static constexpr std::string_view pattern = P.view();
+        static constexpr pattern_kind kind = classify(pattern);
+        // Part of prefix or suffix pattern that has to be compared.
+        static constexpr std::string_view literal = strip_stars(pattern);
+
+        constexpr explicit static_matcher(std::string_view) noexcept {}
+
+        static constexpr bool exact() noexcept
+        {
+            return kind == pattern_kind::exact;
+        }
+
+        static constexpr std::string_view prefix() noexcept
+        {
+            if constexpr (kind == pattern_kind::exact ||
+                          kind == pattern_kind::prefix)
+                return literal;
+            else
+                return literal_prefix(pattern);
+        }
+
+        template <bool counted>
+        static bool matches(std::string_view str) noexcept
+        {
+            if constexpr (kind == pattern_kind::any)
+                return true;
+            else if constexpr (kind == pattern_kind::exact)
+                return str == pattern;
+            else if constexpr (kind == pattern_kind::prefix)
+                return str.starts_with(literal);
+            else if constexpr (kind == pattern_kind::suffix)
+                return str.ends_with(literal);
+            else
+                return satisfies_pattern<counted>(str, pattern);
+        }
+    };
+
+    /**
+     * People of type T that can satisfy given patterns, in order of results
+     * of find<T> - by surnames and then names. Scan decides once which
+     * people have to be checked at all. Range of people_names with literal
+     * prefix of name pattern, or candidates from trigram index, is ordered
+     * by names, so such people are collected and sorted by surnames when
+     * scan is made. Otherwise people_surnames is walked, from literal
+     * prefix of surname pattern if there is one. Patterns are matched when
+     * position is advanced, so results can be consumed lazily.
+     */
+    template <IsAcademic T, typename NameMatcher, typename SurnameMatcher>
+    class people_scan
+    {
+    public:
+        using key_type = person_key;
+        using value_type = std::shared_ptr<T>;
+        using cursor_type = std::pair<std::string, std::string>;
+        using entry_type = person_entry;
+
+        static value_type value(const person_entry &entry) noexcept
+        {
+            return entry.as<T>();
+        }
+
+        static cursor_type cursor(const person_entry &entry)
+        {
+            return cursor_type(entry.person->get_name(),
+                               entry.person->get_surname());
+        }
+
+        static key_type key(const cursor_type &cursor) noexcept
+        {
+            return key_type(cursor.first, cursor.second);
+        }
+
+        struct position
+        {
+            surname_index::const_iterator surname_iter;
+            std::size_t candidate = 0;
+        };
+
+        people_scan(const people_scan &) = delete;
+
+        people_scan(const college_state &_state,
+                    std::string_view _name_pattern,
+                    std::string_view _surname_pattern) :
+            state(_state), name_pattern(_name_pattern),
+            surname_pattern(_surname_pattern), name_matcher(name_pattern),
+            surname_matcher(surname_pattern),
+            name_prefix(name_matcher.prefix()),
+            exact_name(name_matcher.exact()),
+            surname_prefix(surname_matcher.prefix())
+        {
+            bool by_names = exact_name || !name_prefix.empty();
+
+            // Walk from surname prefix is already in order, so it is used
+            // whenever there is no name prefix.
+            if (!by_names && !surname_prefix.empty())
+                return;
+
+            // Without usable name prefix we try to narrow search down with
+            // trigram indexes of names and surnames.
+            std::optional<std::set<person_key>> narrowed;
+            if (state.ngrams && name_prefix.size() <
+                decltype(state.ngrams->name_ngrams)::gram_len)
+            {
+                state.ngrams->name_ngrams.narrow(name_pattern, narrowed);
+                state.ngrams->surname_ngrams.narrow(surname_pattern,
+                                                    narrowed);
+            }
+
+            if (narrowed.has_value())
+            {
+                candidates.emplace();
+                for (const person_key &key : *narrowed)
+                    collect(key, state.people_names.find(key)->second);
+            }
+            else if (by_names)
+            {
+                // people_names is sorted by names and then surnames, so we
+                // start from the first name that can have literal prefix of
+                // name_pattern. If name is given exactly, we can also seek
+                // by surname prefix.
+                candidates.emplace();
+                for (auto iter = state.people_names.lower_bound(person_key(
+                         name_prefix, exact_name ? surname_prefix :
+                         std::string_view()));
+                     iter != state.people_names.end() &&
+                     in_range(iter->first); ++iter)
+                    collect(iter->first, iter->second);
+            }
+            else
+                return;
+
+            std::sort(candidates->begin(), candidates->end(),
+                      surname_less());
+        }
+
+        // Function returns position of the first person that can match, or
+        // of the first one after given key.
+        position start(const person_key *after = nullptr) const
+        {
+            position pos;
+
+            if (candidates.has_value())
+            {
+                if (after != nullptr)
+                    pos.candidate = std::upper_bound(candidates->begin(),
+                        candidates->end(), *after, surname_less()) -
+                        candidates->begin();
+                return pos;
+            }
+
+            if (after != nullptr && !(after->second < surname_prefix))
+                pos.surname_iter = state.people_surnames.upper_bound(*after);
+            else
+                pos.surname_iter =
+                    state.people_surnames.lower_bound(surname_prefix);
+
+            return pos;
+        }
+
+        // Function moves position to the first matching person (not before
+        // it) and returns its entry, or nullptr if there are no more.
+        template <bool counted = false>
+        const person_entry *match(position &pos) const
+        {
+            if (candidates.has_value())
+            {
+                for (; pos.candidate < candidates->size(); ++pos.candidate)
+                    if (auto entry = matching<counted>(
+                            (*candidates)[pos.candidate]))
+                        return entry;
+                return nullptr;
+            }
+
+            for (; pos.surname_iter != state.people_surnames.end() &&
+                   pos.surname_iter->surname.starts_with(surname_prefix);
+                 ++pos.surname_iter)
+                if (auto entry = matching<counted>(*pos.surname_iter))
+                    return entry;
+
+            pos.surname_iter = state.people_surnames.end();
+            return nullptr;
+        }
+
+        // True if scan has to check every person in college - there is
+        // neither name or surname prefix nor trigram candidates to narrow
+        // it down.
+        bool full() const noexcept
+        {
+            return !candidates.has_value() && surname_prefix.empty();
+        }
+
+        void advance(position &pos) const
+        {
+            if (candidates.has_value())
+                ++pos.candidate;
+            else
+                ++pos.surname_iter;
+        }
+
+    private:
+        const college_state &state;
+        // Scan doesn't own patterns, whoever keeps scan keeps them too.
+        std::string_view name_pattern;
+        std::string_view surname_pattern;
+        NameMatcher name_matcher;
+        SurnameMatcher surname_matcher;
+        std::string_view name_prefix;
+        bool exact_name;
+        std::string_view surname_prefix;
+        // People of type T from range of people_names (or from trigram
+        // index), sorted by surname_less. Empty optional if we walk
+        // people_surnames instead.
+        std::optional<std::vector<surname_key>> candidates;
+
+        void collect(const person_key &key, person_id id)
+        {
+            const person_entry &entry = state.people_by_id[id];
+            if (entry.has_role<T>())
+                candidates->push_back(surname_key{key.second,
+                                                  entry.person.get()});
+        }
+
+        bool in_range(const person_key &key) const noexcept
+        {
+            if (exact_name)
+                return key.first == name_pattern &&
+                    key.second.starts_with(surname_prefix);
+
+            return key.first.starts_with(name_prefix);
+        }
+
+        // Function returns entry of person if it matches, nullptr otherwise.
+        // Surname is kept in key, so people whose surnames don't match cost
+        // us no visit of their entries. Role is only a null check of pointer
+        // remembered in entry, so it is checked before name.
+        template <bool counted>
+        const person_entry *matching(const surname_key &key) const noexcept
+        {
+            if (!surname_matcher.template matches<counted>(key.surname))
+                return nullptr;
+
+            const person_entry &entry = state.people_by_id[key.person->id];
+            if (entry.has_role<T>() &&
+                name_matcher.template matches<counted>(entry.person->name))
+                return &entry;
+            return nullptr;
+        }
+    };
+
+    // Courses satisfying given pattern, in order of names. Works like
+    // people_scan, but course_names is already in order of results, so its
+    // range (or candidates from trigram index) is walked directly.
+    template <typename Matcher>
+    class course_scan
+    {
+    public:
+        using key_type = std::string_view;
+        using value_type = std::shared_ptr<Course>;
+        using cursor_type = std::string;
+        using entry_type = course_entry;
+
+        static value_type value(const course_entry &entry) noexcept
+        {
+            return entry.course;
+        }
+
+        static cursor_type cursor(const course_entry &entry)
+        {
+            return entry.course->get_name();
+        }
+
+        static key_type key(const cursor_type &cursor) noexcept
+        {
+            return cursor;
+        }
+
+        struct position
+        {
+            course_map::const_iterator map_iter;
+            std::set<std::string_view>::const_iterator candidate_iter;
+        };
+
+        course_scan(const course_scan &) = delete;
+
+        course_scan(const college_state &_state,
+                    std::string_view _pattern) :
+            state(_state), pattern(_pattern), matcher(pattern),
+            prefix(matcher.prefix()), exact(matcher.exact())
+        {
+            // Without literal prefix we can only narrow search down with
+            // trigram index (if it is enabled and pattern has long enough
+            // fragments).
+            if (state.ngrams && prefix.size() <
+                decltype(state.ngrams->course_ngrams)::gram_len)
+                state.ngrams->course_ngrams.narrow(pattern, candidates);
+        }
+
+        position start(const std::string_view *after = nullptr) const
+        {
+            position pos;
+
+            if (candidates.has_value())
+            {
+                pos.candidate_iter = after == nullptr ? candidates->begin() :
+                    candidates->upper_bound(*after);
+                return pos;
+            }
+
+            // course_names = map<course name, id of course>
+            // It is sorted by names, so only names starting with literal
+            // prefix of pattern (part before first wildcard) have to be
+            // checked.
+            if (after != nullptr && !(*after < prefix))
+                pos.map_iter = state.course_names.upper_bound(*after);
+            else
+                pos.map_iter = state.course_names.lower_bound(prefix);
+
+            return pos;
+        }
+
+        template <bool counted = false>
+        const course_entry *match(position &pos) const
+        {
+            if (candidates.has_value())
+            {
+                for (; pos.candidate_iter != candidates->end();
+                     ++pos.candidate_iter)
+                {
+                    if (matcher.template matches<counted>(
+                            *pos.candidate_iter))
+                        return &state.courses_by_id[state.course_names.find(
+                            *pos.candidate_iter)->second];
+                }
+                return nullptr;
+            }
+
+            // Pattern without wildcards can match only course of exactly the
+            // same name, which is the first one in range (if any), so we
+            // don't look any further (see advance()).
+            if (exact)
+            {
+                if (pos.map_iter != state.course_names.end() &&
+                    pos.map_iter->first == pattern)
+                    return &state.courses_by_id[pos.map_iter->second];
+
+                pos.map_iter = state.course_names.end();
+                return nullptr;
+            }
+
+            for (; pos.map_iter != state.course_names.end() &&
+                   pos.map_iter->first.starts_with(prefix); ++pos.map_iter)
+            {
+                if (matcher.template matches<counted>(pos.map_iter->first))
+                    return &state.courses_by_id[pos.map_iter->second];
+            }
+
+            pos.map_iter = state.course_names.end();
+            return nullptr;
+        }
+
+        bool full() const noexcept
+        {
+            return !candidates.has_value() && prefix.empty() && !exact;
+        }
+
+        void advance(position &pos) const
+        {
+            if (candidates.has_value())
+                ++pos.candidate_iter;
+            else if (exact)
+                pos.map_iter = state.course_names.end();
+            else
+                ++pos.map_iter;
+        }
+
+    private:
+        const college_state &state;
+        std::string_view pattern;
+        Matcher matcher;
+        std::string_view prefix;
+        bool exact;
+        std::optional<std::set<std::string_view>> candidates;
+    };
+
+    std::shared_ptr<college_state> state;
+    // True once state was given to a snapshot, query or copy of college -
+    // it is copied before the next change then, even if they are already
+    // gone (reference count of state alone doesn't tell us that their
+    // reads are done). Set under shared lock of structure (and exclusive
+    // in-place lock), cleared only under exclusive lock of structure.
+    mutable std::atomic<bool> state_shared = false;
+
+    // Increased by every change of college.
+    std::atomic<std::uint64_t> version = 0;
+
+    void bump_version() noexcept
+    {
+        version.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Function makes sure that state is not shared with any snapshot (or
+    // copy of college), copying it if needed. Copy shares chunks of its
+    // containers with original, so it costs O(size / chunk), and chunks
+    // are copied later only when they are changed. Structure of college
+    // has to be locked exclusively.
+    void unshare_state()
+    {
+        if (!state_shared)
+            return;
+
+        state = std::allocate_shared<college_state>(
+            std::pmr::polymorphic_allocator<college_state>(state->memory()),
+            *state);
+        state_shared = false;
+    }
+
+    // Function gives state to a snapshot or copy of college. Shared lock of
+    // structure is enough - only calls modifying state in place (under
+    // in-place lock, see lock_unshared_state) have to finish before state
+    // becomes shared, and once it is shared we don't wait for anybody.
+    std::shared_ptr<college_state> share_state() const
+    {
+        std::shared_lock lock(locks.structure);
+        if (!state_shared)
+        {
+            std::unique_lock in_place_lock(locks.in_place);
+            state_shared = true;
+        }
+        return state;
+    }
+
+    // Function locks structure of college in shared mode, making sure that
+    // state is not shared, so it can be modified in place (under entity
+    // locks). Entries of course and person of given ids (if any) can also
+    // be changed in place then - roster of course replaced (see
+    // college_state::unshared_roster) and number of courses of person
+    // updated. Nobody can share them while we hold the locks.
+    using unshared_lock = std::pair<std::shared_lock<std::shared_mutex>,
+                                    std::shared_lock<std::shared_mutex>>;
+
+    unshared_lock lock_unshared_state(
+        std::optional<course_id> course = std::nullopt,
+        std::optional<person_id> person = std::nullopt)
+    {
+        std::shared_lock lock(locks.structure);
+        std::shared_lock in_place_lock(locks.in_place);
+
+        while (state_shared ||
+               (course.has_value() && !state->course_unshared(*course)) ||
+               (person.has_value() && !state->person_unshared(*person)))
+        {
+            in_place_lock.unlock();
+            lock.unlock();
+            {
+                std::unique_lock unique_lock(locks.structure);
+                unshare_state();
+                if (course.has_value())
+                    state->unshare_course(*course);
+                if (person.has_value())
+                    state->unshare_person(*person);
+            }
+            lock.lock();
+            in_place_lock.lock();
+        }
+
+        return unshared_lock(std::move(lock), std::move(in_place_lock));
+    }
+
+    // The same for course and person given by pointers (null or not in
+    // college too).
+    unshared_lock lock_unshared_state(const Course *course,
+                                      const Person *person)
+    {
+        return lock_unshared_state(
+            course == nullptr ? std::nullopt :
+                                std::optional<course_id>(course->id),
+            person == nullptr ? std::nullopt :
+                                std::optional<person_id>(person->id));
+    }
+
+    /**
+     * Locks used when college is shared between threads. Structure of our
+     * maps (and trigram indexes) is guarded by structure mutex - queries take
+     * it shared, adding and removing people and courses take it exclusively
+     * (maps are ordered globally, so prefix queries can use them). Changing
+     * activeness touches only atomic flags, so shared lock is enough.
+     * assign_course also takes it shared, and then locks only shards of
+     * person and course it modifies. Such calls, modifying state in place,
+     * also hold in-place mutex shared - sharing state with snapshot takes it
+     * exclusively (under shared lock of structure). Copying college gives
+     * fresh locks.
+     */
+    struct college_locks
+    {
+        static constexpr std::size_t shards = 64;
+
+        std::shared_mutex structure;
+        std::shared_mutex in_place;
+        std::array<std::mutex, shards> entity_shards;
+
+        college_locks() = default;
+        college_locks(const college_locks &) {}
+        college_locks &operator=(const college_locks &) { return *this; }
+
+        // Entities are at least 16-byte aligned, so low bits of address are
+        // always zero - we mix all the others (Fibonacci hashing) and take
+        // top 6 bits of the product as shard.
+        static std::size_t shard_index(const void *entity) noexcept
+        {
+            static_assert(shards == 64);
+            return static_cast<std::size_t>(
+                (reinterpret_cast<std::uintptr_t>(entity) >> 4) *
+                0x9E3779B97F4A7C15ull >> 58);
+        }
+
+        std::mutex &shard(const void *entity) noexcept
+        {
+            return entity_shards[shard_index(entity)];
+        }
+
+        // Locks shards of both entities (once, if they share it) without
+        // risk of deadlock.
+        auto lock_entities(const void *a, const void *b)
+        {
+            std::mutex &first = shard(a);
+            std::mutex &second = shard(b);
+
+            if (&first == &second)
+                return std::pair(std::unique_lock(first),
+                                 std::unique_lock<std::mutex>());
+
+            std::lock(first, second);
+            return std::pair(std::unique_lock(first, std::adopt_lock),
+                             std::unique_lock(second, std::adopt_lock));
+        }
+    };
+
+    mutable college_locks locks;
+
+    /**
+     * Names of people added to college, so that keys of people of the same
+     * name in our indexes view one string (see person_key_less). People
+     * themselves keep their own names. Only names are pooled - surnames
+     * are mostly unique, and pooling unique strings costs more than it
+     * saves. Pool is used only under unique lock of structure. Names nobody
+     * but pool uses any more are dropped when pool grows twice since the
+     * last pruning, so it costs amortized O(1) per new name. Copy of
+     * college starts with empty pool.
+     */
+    struct shared_names
+    {
+        static constexpr std::size_t min_prune_size = 64;
+
+        std::unordered_map<std::string_view, pooled_name> names;
+        std::size_t prune_size = min_prune_size;
+
+        shared_names() = default;
+        shared_names(const shared_names &) {}
+        shared_names &operator=(const shared_names &) { return *this; }
+
+        pooled_name intern(const std::string &name)
+        {
+            auto iter = names.find(name);
+            if (iter != names.end())
+                return iter->second;
+
+            if (names.size() >= prune_size)
+                prune();
+
+            auto shared = std::make_shared<const std::string>(name);
+            names.emplace(*shared, shared);
+            return shared;
+        }
+
+        // Function drops names of people that are gone (only pool keeps
+        // them). Entries are never given pooled name outside of the lock, so
+        // name seen unused can't be used again before we drop it.
+        void prune()
+        {
+            std::erase_if(names, [](const auto &entry)
+            {
+                return entry.second.use_count() == 1;
+            });
+            prune_size = std::max(2 * names.size(), min_prune_size);
+        }
+    };
+
+    shared_names name_pool;
+
+    /**
+     * LRU cache of query results (see set_query_cache). Results of
+     * different types are kept behind shared_ptr<const void> - key contains
+     * kind of query and type of people, so we always know real type of
+     * result found under given key. Cache has its own mutex, since queries
+     * use it under shared lock of structure. Copy of college starts with
+     * disabled cache.
+     */
+    struct result_cache
+    {
+        struct entry
+        {
+            std::string key;
+            std::uint64_t version;
+            std::shared_ptr<const void> result;
+        };
+
+        std::atomic<std::size_t> capacity = 0;
+        mutable std::mutex mutex;
+        // Most recently used entries are at the front.
+        std::list<entry> entries;
+        std::unordered_map<std::string_view,
+                           std::list<entry>::iterator> index;
+        query_cache_stats stats;
+
+        result_cache() = default;
+        result_cache(const result_cache &) {}
+        result_cache &operator=(const result_cache &) { return *this; }
+
+        std::shared_ptr<const void> get(const std::string &key,
+                                        std::uint64_t version)
+        {
+            std::lock_guard lock(mutex);
+
+            auto iter = index.find(key);
+            if (iter == index.end() || iter->second->version != version)
+            {
+                // Result computed for older version is never used again.
+                if (iter != index.end())
+                {
+                    entries.erase(iter->second);
+                    index.erase(iter);
+                }
+                stats.misses++;
+                return nullptr;
+            }
+
+            stats.hits++;
+            entries.splice(entries.begin(), entries, iter->second);
+            return iter->second->result;
+        }
+
+        void put(std::string key, std::uint64_t version,
+                 std::shared_ptr<const void> result)
+        {
+            std::lock_guard lock(mutex);
+
+            std::size_t limit = capacity.load(std::memory_order_relaxed);
+            if (limit == 0 || index.contains(key))
+                return;
+
+            entries.push_front(entry{std::move(key), version,
+                                     std::move(result)});
+            index.emplace(entries.front().key, entries.begin());
+
+            while (entries.size() > limit)
+            {
+                index.erase(entries.back().key);
+                entries.pop_back();
+                stats.evictions++;
+            }
+        }
+    };
+
+    mutable result_cache query_cache;
+
+    // Pool for parallel scans (see set_parallel_scan), null if they are
+    // disabled. Queries take their own reference to it, so it can be
+    // replaced while they run.
+    struct parallel_scan_config
+    {
+        std::atomic<bool> enabled = false;
+        mutable std::mutex mutex;
+        std::shared_ptr<scan_pool> pool;
+        std::size_t min_size = 0;
+
+        parallel_scan_config() = default;
+        parallel_scan_config(const parallel_scan_config &) {}
+        parallel_scan_config &operator=(const parallel_scan_config &)
+        {
+            return *this;
+        }
+    };
+
+    parallel_scan_config parallel_scans;
+
+    // Function returns pool for scan of given number of people (courses),
+    // or null if scan should run on calling thread.
+    std::shared_ptr<scan_pool> scan_pool_for(std::size_t scan_size) const
+    {
+        if (!parallel_scans.enabled.load(std::memory_order_relaxed))
+            return nullptr;
+
+        std::lock_guard lock(parallel_scans.mutex);
+        if (scan_size < parallel_scans.min_size)
+            return nullptr;
+        return parallel_scans.pool;
+    }
+
+    // Type of people in keys of cached queries.
+    template <IsAcademic T>
+    static constexpr char type_code() noexcept
+    {
+        if constexpr (std::same_as<T, Person>)
+            return 'P';
+        else if constexpr (std::same_as<T, Student>)
+            return 'S';
+        else if constexpr (std::same_as<T, Teacher>)
+            return 'T';
+        else
+            return 'D';
+    }
+
+    // Function returns result of query computed by given function, taking
+    // it from cache if it is there (and valid). Structure of college has to
+    // be locked (shared is enough - results of cached queries depend only
+    // on structure, which doesn't change under shared lock).
+    template <typename F>
+    auto cached_query(std::string key, F &&compute) const
+    {
+        using result_type = decltype(compute());
+
+        if (query_cache.capacity.load(std::memory_order_relaxed) == 0)
+            return compute();
+
+        std::uint64_t current_version = get_version();
+        if (auto hit = query_cache.get(key, current_version))
+            return *std::static_pointer_cast<const result_type>(hit);
+
+        auto result = std::make_shared<const result_type>(compute());
+        query_cache.put(std::move(key), current_version, result);
+        return *result;
+    }
+
+    // Patterns in key are preceded by their lengths, so keys of different
+    // queries never collide.
+    static std::string query_key(char kind, std::string_view first,
+                                 std::string_view second = {})
+    {
+        std::string key(1, kind);
+        key += std::to_string(first.size()) + ':';
+        key += first;
+        key += second;
+        return key;
+    }
+
+    // Metrics are created when they are enabled for the first time and live
+    // as long as college, so pointer loaded by a call stays valid even if
+    // metrics are disabled meanwhile. Null pointer means disabled metrics.
+    std::unique_ptr<CollegeMetrics> metrics_storage;
+    std::atomic<CollegeMetrics *> metrics = nullptr;
+
+    // Work of satisfies_pattern is added here (if metrics are enabled) by
+    // thread that does the measured call.
+    static inline constinit thread_local CollegeMetrics::pattern_work
+        *current_pattern_work = nullptr;
+
+    // Measures one call of our public function, if metrics are enabled.
+    class measured_call
+    {
+    public:
+        measured_call(const College &college,
+                      CollegeMetrics::operation _op) noexcept :
+            metrics(college.metrics.load(std::memory_order_acquire)), op(_op)
+        {
+            if (metrics == nullptr)
+                return;
+
+            outer_work = current_pattern_work;
+            current_pattern_work = &work;
+            start = std::chrono::steady_clock::now();
+        }
+
+        measured_call(const measured_call &) = delete;
+        measured_call &operator=(const measured_call &) = delete;
+
+        ~measured_call()
+        {
+            if (metrics == nullptr)
+                return;
+
+            metrics->record(op, std::chrono::steady_clock::now() - start,
+                            results, work);
+            current_pattern_work = outer_work;
+        }
+
+        void set_results(std::size_t count) noexcept
+        {
+            results = count;
+        }
+
+    private:
+        CollegeMetrics *metrics;
+        CollegeMetrics::operation op;
+        std::chrono::steady_clock::time_point start;
+        std::size_t results = 0;
+        CollegeMetrics::pattern_work work;
+        CollegeMetrics::pattern_work *outer_work = nullptr;
+    };
+
+    /**
+     * Binary format of college file. All numbers are little endian.
+     * Header: magic, format version, reserved word, numbers of courses,
+     * people and assignments, size of payload and its checksum (FNV-1a).
+     * Payload:
+     *   course     - name (u32 length and bytes), active (u8),
+     *   person     - role (u8), active (u8), name, surname,
+     *   assignment - course index (u32), kind (u8), person index (u32).
+     * Courses and people are stored in order of our maps, and assignments
+     * in order of courses, kinds and people, so everything read from file
+     * can be inserted at the end of our containers.
+     */
+    struct file_format
+    {
+        static constexpr std::string_view magic{"COLLEGE\0", 8};
+        static constexpr std::uint32_t format_version = 1;
+        static constexpr std::size_t header_size = 56;
+
+        static constexpr std::uint8_t student_role = 1;
+        static constexpr std::uint8_t teacher_role = 2;
+        static constexpr std::uint8_t phd_student_role = 3;
+
+        static constexpr std::uint8_t attends = 0;
+        static constexpr std::uint8_t handles = 1;
+
+        static std::uint64_t checksum(std::string_view data) noexcept
+        {
+            std::uint64_t hash = 14695981039346656037ull;
+            for (unsigned char c : data)
+            {
+                hash ^= c;
+                hash *= 1099511628211ull;
+            }
+            return hash;
+        }
+
+        static void put_uint(std::string &out, std::uint64_t value,
+                             std::size_t bytes)
+        {
+            for (std::size_t i = 0; i < bytes; i++)
+                out.push_back(static_cast<char>(value >> (8 * i)));
+        }
+
+        static void put_string(std::string &out, std::string_view str)
+        {
+            if (str.size() > UINT32_MAX)
+                throw college_file_exception();
+
+            put_uint(out, str.size(), 4);
+            out.append(str);
+        }
+    };
+
+    // Reads numbers and strings from file, checking that they don't go past
+    // its end. Returned strings are views of mapped file.
+    struct file_reader
+    {
+        const char *pos;
+        const char *end;
+
+        std::uint64_t get_uint(std::size_t bytes)
+        {
+            if (static_cast<std::size_t>(end - pos) < bytes)
+                throw corrupted_file_exception();
+
+            std::uint64_t value = 0;
+            for (std::size_t i = 0; i < bytes; i++)
+                value |= std::uint64_t(static_cast<unsigned char>(*pos++))
+                    << (8 * i);
+            return value;
+        }
+
+        std::string_view get_string()
+        {
+            std::size_t size = get_uint(4);
+            if (static_cast<std::size_t>(end - pos) < size)
+                throw corrupted_file_exception();
+
+            std::string_view str(pos, size);
+            pos += size;
+            return str;
+        }
+    };
+
+    // Read-only view of whole file. On POSIX systems file is mapped into
+    // memory (and read ahead by the kernel), elsewhere it is simply read.
+    class mapped_file
+    {
+    public:
+        explicit mapped_file(const std::string &path)
+        {
+#if COLLEGE_HAS_MMAP
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw college_file_exception();
+
+            struct stat info;
+            bool ok = ::fstat(fd, &info) == 0;
+            if (ok && info.st_size > 0)
+            {
+                size = static_cast<std::size_t>(info.st_size);
+                addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                ok = addr != MAP_FAILED;
+                if (ok)
+                    ::madvise(addr, size, MADV_SEQUENTIAL);
+                else
+                    addr = nullptr;
+            }
+            ::close(fd);
+
+            if (!ok)
+                throw college_file_exception();
+#else
+            std::ifstream in(path, std::ios::binary);
+            if (!in)
+                throw college_file_exception();
+            contents.assign(std::istreambuf_iterator<char>(in),
+                            std::istreambuf_iterator<char>());
+#endif
+        }
+
+        mapped_file(const mapped_file &) = delete;
+        mapped_file &operator=(const mapped_file &) = delete;
+
+        ~mapped_file()
+        {
+#if COLLEGE_HAS_MMAP
+            if (addr != nullptr)
+                ::munmap(addr, size);
+#endif
+        }
+
+        std::string_view data() const noexcept
+        {
+#if COLLEGE_HAS_MMAP
+            return std::string_view(static_cast<const char *>(addr), size);
+#else
+            return contents;
+#endif
+        }
+
+    private:
+#if COLLEGE_HAS_MMAP
+        void *addr = nullptr;
+        std::size_t size = 0;
+#else
+        std::string contents;
+#endif
+    };
+
+    /**
+     * Format of log of changes (see open_log). Header: magic, format
+     * version and generation of log. College file written by compaction
+     * keeps generation of the last log it contains in its reserved word, so
+     * that log is skipped when college is opened. Then records: size of
+     * payload (u32), its checksum (FNV-1a, u64) and payload - kind of change
+     * (u8) and its arguments, stored the same way as in college file:
+     *   add_course     - name, active,
+     *   remove_course  - name,
+     *   course_active  - name, active,
+     *   add_person     - role, active, name, surname,
+     *   remove_person  - name, surname,
+     *   student_active - name, surname, active,
+     *   assign         - kind, name, surname, course,
+     *   unassign       - kind, name, surname, course.
+     * Record torn by crash fails its checksum and ends the log.
+     */
+    struct log_format
+    {
+        static constexpr std::string_view magic{"COLLOG\0\0", 8};
+        static constexpr std::uint32_t format_version = 1;
+        static constexpr std::size_t header_size = 16;
+        static constexpr std::size_t record_header_size = 12;
+
+        enum change : std::uint8_t
+        {
+            add_course, remove_course, course_active, add_person,
+            remove_person, student_active, assign, unassign
+        };
+
+        template <IsAcademic T>
+        static constexpr std::uint8_t role() noexcept
+        {
+            if constexpr (std::same_as<T, Student>)
+                return file_format::student_role;
+            else if constexpr (std::same_as<T, Teacher>)
+                return file_format::teacher_role;
+            else
+                return file_format::phd_student_role;
+        }
+
+        template <StudentTeacher T>
+        static constexpr std::uint8_t kind() noexcept
+        {
+            return std::same_as<T, Student> ? file_format::attends :
+                file_format::handles;
+        }
+
+        static void put_field(std::string &out, std::string_view str)
+        {
+            file_format::put_string(out, str);
+        }
+
+        static void put_field(std::string &out, std::uint8_t value)
+        {
+            file_format::put_uint(out, value, 1);
+        }
+
+        template <typename... Fields>
+        static std::string record(change kind, const Fields &...fields)
+        {
+            std::string payload(1, static_cast<char>(kind));
+            (put_field(payload, fields), ...);
+
+            std::string record;
+            record.reserve(record_header_size + payload.size());
+            file_format::put_uint(record, payload.size(), 4);
+            file_format::put_uint(record, file_format::checksum(payload), 8);
+            record += payload;
+            return record;
+        }
+    };
+
+    // Function flushes file and syncs it to disk (where it is possible).
+    static bool sync_file(std::FILE *file)
+    {
+        if (std::fflush(file) != 0)
+            return false;
+#if COLLEGE_HAS_FSYNC
+        return ::fsync(::fileno(file)) == 0;
+#else
+        return true;
+#endif
+    }
+
+    // New and renamed files are durable only when their directory is synced.
+    static bool sync_directory(const std::string &path)
+    {
+#if COLLEGE_HAS_FSYNC
+        std::size_t slash = path.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "." :
+            path.substr(0, slash + 1);
+
+        int fd = ::open(directory.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        bool ok = ::fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+#else
+        return true;
+#endif
+    }
+
+    // Function creates empty log of given generation, synced to disk.
+    static std::FILE *create_log(const std::string &path,
+                                 std::uint32_t generation)
+    {
+        std::string header(log_format::magic);
+        file_format::put_uint(header, log_format::format_version, 4);
+        file_format::put_uint(header, generation, 4);
+
+        std::FILE *file = std::fopen(path.c_str(), "wb");
+        if (file == nullptr)
+            throw college_file_exception();
+
+        if (std::fwrite(header.data(), 1, header.size(), file) !=
+            header.size() || !sync_file(file) || !sync_directory(path))
+        {
+            std::fclose(file);
+            std::remove(path.c_str());
+            throw college_file_exception();
+        }
+        return file;
+    }
+
+    /**
+     * Open log of changes (see open_log). Records are appended to buffer
+     * under locks of college, so they are in order of changes. Flusher
+     * thread writes buffer and syncs file - records appended while it
+     * syncs wait for the next sync together. Positions of records count
+     * bytes appended since log was opened (through all its files).
+     * Compaction creates next file (path + ".log.next"), notes position
+     * from which records go to it (flusher switches files there), writes
+     * college file on its own thread and then renames next file to the log.
+     */
+    class mutation_log
+    {
+    public:
+        mutation_log(std::string _path, const log_options &_options,
+                     std::FILE *_file, std::uint32_t _generation,
+                     std::uint64_t size) :
+            path(std::move(_path)), options(_options), file(_file),
+            generation(_generation), file_size(size),
+            flusher([this] { flush_loop(); }) {}
+
+        mutation_log(const mutation_log &) = delete;
+        mutation_log &operator=(const mutation_log &) = delete;
+
+        ~mutation_log()
+        {
+            try
+            {
+                close();
+            }
+            catch (const std::exception &)
+            {
+            }
+        }
+
+        // Function returns position right after appended record.
+        std::uint64_t append(std::string_view record)
+        {
+            std::lock_guard lock(mutex);
+
+            buffer.append(record);
+            appended += record.size();
+            file_size += record.size();
+            wake.notify_one();
+            return appended;
+        }
+
+        void wait_durable(std::uint64_t position)
+        {
+            std::unique_lock lock(mutex);
+
+            synced.wait(lock, [&] { return durable >= position || failed; });
+            if (durable < position)
+                throw college_file_exception();
+        }
+
+        bool wants_compaction()
+        {
+            std::lock_guard lock(mutex);
+
+            return options.compact_size != 0 && !compacting && !failed &&
+                file_size >= options.compact_size;
+        }
+
+        // Function claims compaction and creates next file, without any
+        // lock of college, so that nobody waits for its syncs (or for thread
+        // of previous compaction). It returns false if compaction can't
+        // start - log failed or is closed, or compaction already runs and
+        // wait is false (with wait it waits for that compaction first).
+        // Claimed compaction is then started or cancelled.
+        bool prepare_compaction(bool wait)
+        {
+            {
+                std::unique_lock lock(mutex);
+                if (wait)
+                    idle.wait(lock, [&] { return !compacting; });
+                if (compacting || failed || closed)
+                    return false;
+                compacting = true;
+            }
+            // Previous compaction is done, but its thread may be unjoined.
+            if (compactor.joinable())
+                compactor.join();
+
+            std::FILE *next;
+            try
+            {
+                next = create_log(path + ".log.next", generation + 1);
+            }
+            catch (const college_file_exception &)
+            {
+                cancel_compaction();
+                return false;
+            }
+
+            std::lock_guard lock(mutex);
+            next_file = next;
+            return true;
+        }
+
+        // Structure of college has to be locked exclusively, so that nothing
+        // changes between switch of logs and taking state of college. Only
+        // position of switch is noted here - flusher moves to next file
+        // once records before it are synced, and college file is written by
+        // another thread.
+        void start_compaction(std::shared_ptr<const college_state> saved)
+        {
+            std::unique_lock lock(mutex);
+            if (closed || failed)
+            {
+                lock.unlock();
+                cancel_compaction();
+                return;
+            }
+
+            switch_position = appended;
+            file_size = log_format::header_size;
+            std::uint32_t compacted = generation++;
+            wake.notify_one();
+            lock.unlock();
+
+            compactor = std::thread(
+                [this, saved = std::move(saved), compacted]() mutable
+                {
+                    bool ok;
+                    try
+                    {
+                        write_file(*saved, path, compacted);
+                        std::string next_path = path + ".log.next";
+                        std::string log_path = path + ".log";
+                        ok = std::rename(next_path.c_str(),
+                                         log_path.c_str()) == 0 &&
+                            sync_directory(path);
+                    }
+                    catch (const std::exception &)
+                    {
+                        ok = false;
+                    }
+                    saved.reset();
+
+                    std::lock_guard lock(mutex);
+                    compacting = false;
+                    idle.notify_all();
+                    if (!ok)
+                    {
+                        failed = true;
+                        synced.notify_all();
+                    }
+                });
+        }
+
+        // Function gives up compaction claimed by prepare_compaction.
+        void cancel_compaction()
+        {
+            std::lock_guard lock(mutex);
+            if (next_file != nullptr)
+            {
+                std::fclose(std::exchange(next_file, nullptr));
+                std::remove((path + ".log.next").c_str());
+            }
+            compacting = false;
+            idle.notify_all();
+        }
+
+        // Function writes rest of log, waits for compaction and closes file.
+        void close()
+        {
+            {
+                std::lock_guard lock(mutex);
+                if (closed)
+                    return;
+                closed = true;
+            }
+            wake.notify_one();
+            flusher.join();
+            {
+                // Compaction claimed before log was closed is cancelled by
+                // its caller.
+                std::unique_lock lock(mutex);
+                idle.wait(lock, [&] { return !compacting; });
+            }
+            if (compactor.joinable())
+                compactor.join();
+            std::fclose(file);
+
+            if (failed)
+                throw college_file_exception();
+        }
+
+    private:
+        void flush_loop()
+        {
+            std::unique_lock lock(mutex);
+
+            while (true)
+            {
+                wake.wait(lock, [&]
+                          {
+                              return !buffer.empty() || switching() ||
+                                  closed;
+                          });
+                if (buffer.empty() && !switching())
+                    return;
+
+                if (options.commit_delay.count() > 0 && !closed &&
+                    !switching())
+                {
+                    lock.unlock();
+                    std::this_thread::sleep_for(options.commit_delay);
+                    lock.lock();
+                }
+
+                // Everything appended so far is written by one sync - up to
+                // switch of logs, if there is one, rest goes to next file.
+                // After failure nothing is written any more.
+                std::uint64_t start = appended - buffer.size();
+                std::size_t size = buffer.size();
+                bool switch_after = switching() &&
+                    switch_position <= start + size;
+                if (switch_after)
+                    size = switch_position - start;
+                writing_buffer.assign(buffer, 0, size);
+                buffer.erase(0, size);
+                std::uint64_t target = start + size;
+                std::FILE *out = file;
+                bool ok = !failed;
+                writing = true;
+                lock.unlock();
+
+                ok = ok && (writing_buffer.empty() ||
+                            (std::fwrite(writing_buffer.data(), 1,
+                                         writing_buffer.size(), out) ==
+                             writing_buffer.size() && sync_file(out)));
+                writing_buffer.clear();
+
+                lock.lock();
+                writing = false;
+                if (ok)
+                    durable = target;
+                else
+                    failed = true;
+                if (switch_after)
+                {
+                    std::fclose(file);
+                    file = std::exchange(next_file, nullptr);
+                    switch_position = no_switch;
+                }
+                synced.notify_all();
+            }
+        }
+
+        // True if compaction started and flusher has yet to move to next
+        // file.
+        bool switching() const noexcept
+        {
+            return next_file != nullptr && switch_position != no_switch;
+        }
+
+        const std::string path;
+        const log_options options;
+        std::FILE *file;
+        // Changed only under exclusive lock of college structure (read by
+        // compaction that claimed it).
+        std::uint32_t generation;
+        std::uint64_t file_size;
+
+        std::mutex mutex;
+        // Flusher waits for records on wake, writers wait for sync on synced.
+        std::condition_variable wake;
+        std::condition_variable synced;
+        std::string buffer;
+        std::string writing_buffer;
+        std::uint64_t appended = 0;
+        std::uint64_t durable = 0;
+        bool writing = false;
+        bool compacting = false;
+        bool failed = false;
+        bool closed = false;
+        // Next file of claimed compaction and position at which records go
+        // to it (no_switch until compaction starts).
+        static constexpr std::uint64_t no_switch = UINT64_MAX;
+        std::FILE *next_file = nullptr;
+        std::uint64_t switch_position = no_switch;
+        // Waited on for end of compaction.
+        std::condition_variable idle;
+
+        std::thread compactor;
+        // Started last, when everything it uses is initialized.
+        std::thread flusher;
+    };
+
+    // Open log, null if college isn't logged. Changing calls read it under
+    // lock of structure and keep their own reference to it. Copy of college
+    // isn't logged.
+    struct log_slot
+    {
+        std::shared_ptr<mutation_log> log;
+
+        log_slot() = default;
+        log_slot(const log_slot &) {}
+        log_slot &operator=(const log_slot &) { return *this; }
+    };
+
+    log_slot logging;
+
+    // Function starts compaction of given log claimed by prepare_compaction,
+    // with current state of college, unless log was closed meanwhile.
+    // Structure of college has to be locked exclusively.
+    void start_compaction(const std::shared_ptr<mutation_log> &log)
+    {
+        if (logging.log != log)
+        {
+            log->cancel_compaction();
+            return;
+        }
+
+        state_shared = true;
+        log->start_compaction(state);
+    }
+
+    /**
+     * Appends records of one changing call to log (if college is logged).
+     * Call ends with commit(), which releases locks of call and then waits
+     * until its records are synced, together with other calls. Call that
+     * throws before commit() doesn't wait for records it made.
+     */
+    class logged_call
+    {
+    public:
+        explicit logged_call(College &_college) noexcept : college(_college)
+        {}
+
+        logged_call(const logged_call &) = delete;
+        logged_call &operator=(const logged_call &) = delete;
+
+        // Structure of college has to be locked (shared is enough).
+        template <typename... Fields>
+        void record(log_format::change kind, const Fields &...fields)
+        {
+            if (college.logging.log == nullptr)
+                return;
+
+            if (log == nullptr)
+                log = college.logging.log;
+            position = log->append(log_format::record(kind, fields...));
+        }
+
+        // Function unlocks given locks (the ones it owns), and waits for
+        // records of call, if there are any. It throws if log can't be
+        // written.
+        template <typename... Locks>
+        void commit(Locks &...locks)
+        {
+            (release(locks), ...);
+
+            if (log == nullptr)
+                return;
+
+            log->wait_durable(position);
+
+            if (log->wants_compaction())
+            {
+                try
+                {
+                    college.compact_log();
+                }
+                // Log is still fine, next call tries to compact it again.
+                catch (const college_file_exception &)
+                {
+                }
+            }
+        }
+
+    private:
+        College &college;
+        std::shared_ptr<mutation_log> log;
+        std::uint64_t position = 0;
+
+        template <typename Lock>
+        static void release(Lock &lock)
+        {
+            if (lock.owns_lock())
+                lock.unlock();
+        }
+
+        template <typename First, typename Second>
+        static void release(std::pair<First, Second> &locks)
+        {
+            release(locks.second);
+            release(locks.first);
+        }
+    };
+
+    // Versions of save and load used by log - they write and read generation
+    // of log compacted into college file.
+    static void write_file(const college_state &saved, const std::string &path,
+                           std::uint32_t log_generation);
+
+    static College load(const std::string &path,
+                        std::pmr::memory_resource *resource,
+                        std::uint32_t *log_generation);
+
+    // Functions apply log of changes (records without header of file) to
+    // state, which can't be shared. replay_log returns size of complete
+    // records - the rest was torn by crash.
+    std::size_t replay_log(std::string_view records);
+    void replay_record(file_reader &reader);
+
+    template <StudentTeacher T>
+    void replay_assignment(bool assign, const person_entry &person,
+                           course_id course);
+
+    // Functions change activeness, keeping counters of active courses and
+    // students (state can't be shared). They return false if it was
+    // already as given.
+    bool set_activeness(Course &course, bool active) noexcept
+    {
+        if (course.active.exchange(active, std::memory_order_relaxed) ==
+            active)
+            return false;
+
+        if (active)
+            state->active_courses++;
+        else
+            state->active_courses--;
+        return true;
+    }
+
+    bool set_activeness(Student &student, bool active) noexcept
+    {
+        if (student.active.exchange(active, std::memory_order_relaxed) ==
+            active)
+            return false;
+
+        if (active)
+            state->active_students++;
+        else
+            state->active_students--;
+        return true;
+    }
+
+    // One row of imported dump. Fields are indexed the same way as columns
+    // of CSV dump.
+    enum class import_type { course, student, teacher, phd_student, attends,
+                             handles };
+
+    struct import_row
+    {
+        static constexpr std::array<std::string_view, 5> field_names{
+            "type", "name", "surname", "course", "active"};
+
+        std::size_t line;
+        import_type type;
+        std::string name;
+        std::string surname;
+        std::string course;
+        bool active;
+    };
+
+    using import_fields = std::array<std::string, 5>;
+
+    // Function splits CSV line into fields. It returns error message or
+    // nullptr if line is correct.
+    static const char *parse_csv_row(std::string_view line,
+                                     import_fields &fields)
+    {
+        for (auto &field : fields)
+            field.clear();
+
+        std::size_t i = 0;
+        for (std::size_t field = 0; ; field++)
+        {
+            if (field == fields.size())
+                return "Too many fields.";
+
+            std::string &out = fields[field];
+            if (i < line.size() && line[i] == '"')
+            {
+                // Quoted field, "" stands for one quote.
+                for (i++; ; i++)
+                {
+                    if (i >= line.size())
+                        return "Unterminated quoted field.";
+                    if (line[i] == '"')
+                    {
+                        if (i + 1 < line.size() && line[i + 1] == '"')
+                            i++;
+                        else
+                            break;
+                    }
+                    out.push_back(line[i]);
+                }
+                i++;
+                if (i < line.size() && line[i] != ',')
+                    return "Unexpected character after quoted field.";
+            }
+            else
+            {
+                std::size_t end = std::min(line.find(',', i), line.size());
+                out.assign(line.substr(i, end - i));
+                i = end;
+            }
+
+            if (i >= line.size())
+                return nullptr;
+            i++;
+        }
+    }
+
+    // Function reads flat JSON object (values are strings, booleans,
+    // numbers or nulls) into fields. Keys we don't know are ignored.
+    static const char *parse_json_row(std::string_view line,
+                                      import_fields &fields)
+    {
+        for (auto &field : fields)
+            field.clear();
+
+        std::size_t i = 0;
+        auto skip_spaces = [&]()
+        {
+            while (i < line.size() && (line[i] == ' ' || line[i] == '\t'))
+                i++;
+        };
+
+        // Reads string starting at i (after opening quote).
+        auto read_string = [&](std::string &out) -> const char *
+        {
+            for (i++; i < line.size() && line[i] != '"'; i++)
+            {
+                if (line[i] != '\\')
+                {
+                    out.push_back(line[i]);
+                    continue;
+                }
+
+                if (++i >= line.size())
+                    break;
+
+                switch (line[i])
+                {
+                case 'b': out.push_back('\b'); break;
+                case 'f': out.push_back('\f'); break;
+                case 'n': out.push_back('\n'); break;
+                case 'r': out.push_back('\r'); break;
+                case 't': out.push_back('\t'); break;
+                case 'u':
+                {
+                    auto hex = [&](std::size_t from, std::uint32_t &code)
+                    {
+                        code = 0;
+                        for (std::size_t j = from; j < from + 4; j++)
+                        {
+                            if (j >= line.size() || !std::isxdigit(
+                                static_cast<unsigned char>(line[j])))
+                                return false;
+                            code = code * 16 + (line[j] <= '9' ?
+                                line[j] - '0' : (line[j] | 0x20) - 'a' + 10);
+                        }
+                        return true;
+                    };
+
+                    std::uint32_t code, low;
+                    if (!hex(i + 1, code))
+                        return "Invalid escape sequence.";
+                    i += 4;
+                    // Surrogate pair encodes one character.
+                    if (code >= 0xD800 && code < 0xDC00 &&
+                        line.substr(i + 1, 2) == "\\u" && hex(i + 3, low) &&
+                        low >= 0xDC00 && low < 0xE000)
+                    {
+                        code = 0x10000 + ((code - 0xD800) << 10) +
+                            (low - 0xDC00);
+                        i += 6;
+                    }
+
+                    // UTF-8 encoding of code point.
+                    if (code < 0x80)
+                        out.push_back(static_cast<char>(code));
+                    else if (code < 0x800)
+                    {
+                        out.push_back(static_cast<char>(0xC0 | (code >> 6)));
+                        out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                    }
+                    else if (code < 0x10000)
+                    {
+                        out.push_back(static_cast<char>(0xE0 | (code >> 12)));
+                        out.push_back(static_cast<char>(
+                            0x80 | ((code >> 6) & 0x3F)));
+                        out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                    }
+                    else
+                    {
+                        out.push_back(static_cast<char>(0xF0 | (code >> 18)));
+                        out.push_back(static_cast<char>(
+                            0x80 | ((code >> 12) & 0x3F)));
+                        out.push_back(static_cast<char>(
+                            0x80 | ((code >> 6) & 0x3F)));
+                        out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                    }
+                    break;
+                }
+                default:
+                    // \", \\ and \/ stand for the character itself.
+                    out.push_back(line[i]);
+                }
+            }
+
+            if (i >= line.size())
+                return "Unterminated string.";
+            i++;
+            return nullptr;
+        };
+
+        skip_spaces();
+        if (i >= line.size() || line[i] != '{')
+            return "Expected JSON object.";
+        i++;
+        skip_spaces();
+
+        if (i < line.size() && line[i] == '}')
+            i++;
+        else
+        {
+            std::string key, value;
+            while (true)
+            {
+                key.clear();
+                value.clear();
+
+                if (i >= line.size() || line[i] != '"')
+                    return "Expected key.";
+                if (auto error = read_string(key))
+                    return error;
+
+                skip_spaces();
+                if (i >= line.size() || line[i] != ':')
+                    return "Expected ':'.";
+                i++;
+                skip_spaces();
+
+                if (i < line.size() && line[i] == '"')
+                {
+                    if (auto error = read_string(value))
+                        return error;
+                }
+                else
+                {
+                    // true, false, null or number - we keep its text.
+                    std::size_t end = line.find_first_of(",} \t", i);
+                    end = std::min(end, line.size());
+                    value.assign(line.substr(i, end - i));
+                    i = end;
+                    if (value.empty())
+                        return "Expected value.";
+                    if (value == "null")
+                        value.clear();
+                }
+
+                auto name = std::find(import_row::field_names.begin(),
+                    import_row::field_names.end(), key);
+                if (name != import_row::field_names.end())
+                    fields[name - import_row::field_names.begin()] =
+                        std::move(value);
+
+                skip_spaces();
+                if (i < line.size() && line[i] == ',')
+                {
+                    i++;
+                    skip_spaces();
+                }
+                else if (i < line.size() && line[i] == '}')
+                {
+                    i++;
+                    break;
+                }
+                else
+                    return "Expected ',' or '}'.";
+            }
+        }
+
+        skip_spaces();
+        return i == line.size() ? nullptr : "Unexpected text after object.";
+    }
+
+    // Function checks fields of a row and fills the row with them.
+    static const char *make_import_row(import_fields &fields, import_row &row)
+    {
+        static constexpr std::array<std::string_view, 6> type_names{
+            "course", "student", "teacher", "phd_student", "attends",
+            "handles"};
+
+        auto type = std::find(type_names.begin(), type_names.end(),
+                              fields[0]);
+        if (type == type_names.end())
+            return "Unknown row type.";
+        row.type = import_type(type - type_names.begin());
+
+        const std::string &active = fields[4];
+        if (active.empty() || active == "1" || active == "true")
+            row.active = true;
+        else if (active == "0" || active == "false")
+            row.active = false;
+        else
+            return "Invalid active flag.";
+
+        bool needs_person = row.type != import_type::course;
+        bool needs_course = row.type == import_type::course ||
+            row.type == import_type::attends ||
+            row.type == import_type::handles;
+
+        if (needs_person && (fields[1].empty() || fields[2].empty()))
+            return "Missing name or surname.";
+        if (needs_course && fields[3].empty())
+            return "Missing course.";
+
+        row.name = std::move(fields[1]);
+        row.surname = std::move(fields[2]);
+        row.course = std::move(fields[3]);
+        return nullptr;
+    }
+
+    // Function returns position for new key in map, going straight to its
+    // end when key is greater than every key present (which is the case
+    // when sorted dump is loaded). Key is present if it is at returned
+    // position.
+    template <typename Map, typename Key>
+    static auto insert_position(const Map &map, const Key &key)
+    {
+        if (map.empty() || map.back().first < key)
+            return map.end();
+        return map.lower_bound(key);
+    }
+
+    // Function creates person together with its name taken from name_pool.
+    // Teacher is the only one of our people without activeness. Structure
+    // of college has to be locked uniquely.
+    template <IsAcademic T>
+    new_person<T> make_person(const std::string &name,
+                              const std::string &surname, bool active)
+    {
+        std::pmr::memory_resource *resource = state->memory();
+        std::pmr::polymorphic_allocator<T> allocator(resource);
+
+        if constexpr (std::same_as<T, Teacher>)
+            return {std::allocate_shared<Teacher>(allocator, name, surname,
+                                                  resource),
+                    name_pool.intern(name)};
+        else
+            return {std::allocate_shared<T>(allocator, name, surname, active,
+                                            resource),
+                    name_pool.intern(name)};
+    }
+
+    std::shared_ptr<Course> make_course(const std::string &name, bool active)
+    {
+        return std::allocate_shared<Course>(
+            std::pmr::polymorphic_allocator<Course>(state->memory()), name,
+            active);
+    }
+
+    // Courses person attends (as a student) or handles (as a teacher).
+    template <StudentTeacher T>
+    static auto &courses_of(T &person) noexcept
+    {
+        if constexpr (std::same_as<T, Student>)
+            return person.subjects_I_attend;
+        else
+            return person.subjects_I_handle;
+    }
+
+    // Ids of people in roster, in its order.
+    static std::vector<person_id> member_ids(const roster_set &members)
+    {
+        std::vector<person_id> ids;
+        ids.reserve(members.size());
+        for (const auto &person : members)
+            ids.push_back(person->id);
+        return ids;
+    }
+
+    // Function returns indexes of items in order given by comparator, so
+    // batches can be inserted sorted and still reported in original order.
+    template <typename Item, typename Compare>
+    static std::vector<std::size_t> sorted_order(
+        const std::vector<Item> &items, Compare cmp)
+    {
+        std::vector<std::size_t> order(items.size());
+        std::iota(order.begin(), order.end(), std::size_t(0));
+        std::stable_sort(order.begin(), order.end(),
+                         [&](std::size_t a, std::size_t b)
+                         {
+                             return cmp(items[a], items[b]);
+                         });
+        return order;
+    }
+
+    // Function applies one batch of imported rows (see bulk_import).
+    void import_batch(std::vector<import_row> &batch,
+                      std::vector<import_error> &errors,
+                      std::size_t &imported, logged_call &logged);
+
+    // Exceptions for differents cases. Naming is self-explanatory.
+    class inactive_student_exception : public std::exception
+    {
+        virtual const char* what() const throw()
+        {
+            return "Incorrect operation for an inactive student.";
+        }
+    };
+
+    class inactive_course_exception : public std::exception
+    {
+        virtual const char* what() const throw()
+        {
+            return "Incorrect operation on an inactive course.";
+        }
+    };
+
+    class non_existing_person_exception : public std::exception
+    {
+        virtual const char* what() const throw()
+        {
+            return "Non-existing person.";
+        }
+    };
+
+    class non_existing_course_exception : public std::exception
+    {
+        virtual const char* what() const throw()
+        {
+            return "Non-existing course.";
+        }
+    };
+
+    class too_many_ids_exception : public std::exception
+    {
+        virtual const char* what() const throw()
+        {
+            return "All ids of people or courses are taken.";
+        }
+    };
+
+    class college_file_exception : public std::exception
+    {
+        virtual const char* what() const throw()
+        {
+            return "Cannot read or write college file.";
+        }
+    };
+
+    class corrupted_file_exception : public std::exception
+    {
+        virtual const char* what() const throw()
+        {
+            return "Corrupted or incompatible college file.";
+        }
+    };
+
+    // Function checks whether given pattern contains any * or ?.
+    static constexpr bool has_wildcards(std::string_view pattern) noexcept
+    {
+        return pattern.find_first_of("*?") != std::string_view::npos;
+    }
+
+    // Function returns part of pattern before its first wildcard. Every
+    // string satisfying pattern has to start with it.
+    static constexpr std::string_view literal_prefix(
+        std::string_view pattern) noexcept
+    {
+        return pattern.substr(0, pattern.find_first_of("*?"));
+    }
+
+    // Function checks whether segment of pattern (part without *, possibly
+    // with ?) matches characters starting at given place.
+    static bool segment_matches(const char *str,
+                                std::string_view segment) noexcept
+    {
+        for (std::size_t i = 0; i < segment.size(); i++)
+        {
+            if (segment[i] != '?' && segment[i] != str[i])
+                return false;
+        }
+        return true;
+    }
+
+    // Function returns first position in text at which segment matches, or
+    // npos. Candidates are positions where first and last non-? characters
+    // of segment fit, only those are compared fully. Width of checked text
+    // and number of rejected candidates are added to counters.
+    static std::size_t find_segment(std::string_view text,
+                                    std::string_view segment,
+                                    std::uint64_t &chars,
+                                    std::uint64_t &backtracks) noexcept
+    {
+        if (text.size() < segment.size())
+            return std::string_view::npos;
+
+        std::size_t first = segment.find_first_not_of('?');
+        // Segment of ? only matches anywhere.
+        if (first == std::string_view::npos)
+            return 0;
+
+        std::size_t last = segment.find_last_not_of('?');
+        std::size_t positions = text.size() - segment.size() + 1;
+        const char *data = text.data();
+        std::size_t pos = 0;
+
+        auto check = [&](std::size_t candidate) noexcept
+        {
+            if (segment_matches(data + candidate, segment))
+                return true;
+            backtracks++;
+            return false;
+        };
+
+#if COLLEGE_SIMD_WIDTH == 32
+        const __m256i first_char = _mm256_set1_epi8(segment[first]);
+        const __m256i last_char = _mm256_set1_epi8(segment[last]);
+        for (; pos + 32 <= positions; pos += 32)
+        {
+            __m256i at_first = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(data + pos + first));
+            __m256i at_last = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(data + pos + last));
+            std::uint32_t mask = static_cast<std::uint32_t>(
+                _mm256_movemask_epi8(_mm256_and_si256(
+                    _mm256_cmpeq_epi8(at_first, first_char),
+                    _mm256_cmpeq_epi8(at_last, last_char))));
+            for (; mask != 0; mask &= mask - 1)
+            {
+                std::size_t candidate = pos + std::countr_zero(mask);
+                if (check(candidate))
+                {
+                    chars += candidate + 1;
+                    return candidate;
+                }
+            }
+        }
+#elif COLLEGE_SIMD_WIDTH == 16
+        const __m128i first_char = _mm_set1_epi8(segment[first]);
+        const __m128i last_char = _mm_set1_epi8(segment[last]);
+        for (; pos + 16 <= positions; pos += 16)
+        {
+            __m128i at_first = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(data + pos + first));
+            __m128i at_last = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(data + pos + last));
+            std::uint32_t mask = static_cast<std::uint32_t>(
+                _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpeq_epi8(at_first, first_char),
+                    _mm_cmpeq_epi8(at_last, last_char))));
+            for (; mask != 0; mask &= mask - 1)
+            {
+                std::size_t candidate = pos + std::countr_zero(mask);
+                if (check(candidate))
+                {
+                    chars += candidate + 1;
+                    return candidate;
+                }
+            }
+        }
+#endif
+
+        // Rest of positions (or all of them without vector instructions).
+        for (; pos < positions; pos++)
+        {
+            if (data[pos + first] == segment[first] &&
+                data[pos + last] == segment[last] && check(pos))
+            {
+                chars += pos + 1;
+                return pos;
+            }
+        }
+
+        chars += positions;
+        return std::string_view::npos;
+    }
+
+    // Function checks whether given string satisfies pattern that has * and ?
+    // Pattern is split by * into segments. First one has to match at the
+    // beginning of string and last one at its end, and the ones between are
+    // searched for from left to right - taking first occurence of every
+    // segment never loses a match, since segments have fixed lengths. So
+    // patterns without *, prefixes, suffixes and * alone are checked in
+    // constant time, without any search. Counted version adds its work to
+    // metrics of current call (see for_each_match).
+    template <bool counted = false>
+    static bool satisfies_pattern(std::string_view str,
+                                  std::string_view pattern) noexcept
+    {
+        std::uint64_t chars = 0, backtracks = 0;
+        auto result = [&](bool matches) noexcept
+        {
+            if constexpr (counted)
+            {
+                current_pattern_work->matches++;
+                current_pattern_work->chars += chars;
+                current_pattern_work->backtracks += backtracks;
+            }
+            return matches;
+        };
+
+        std::size_t first_star = pattern.find('*');
+        if (first_star == std::string_view::npos)
+        {
+            chars = pattern.size();
+            return result(str.size() == pattern.size() &&
+                          segment_matches(str.data(), pattern));
+        }
+
+        std::size_t last_star = pattern.rfind('*');
+        std::string_view head = pattern.substr(0, first_star);
+        std::string_view tail = pattern.substr(last_star + 1);
+        if (str.size() < head.size() + tail.size())
+            return result(false);
+
+        chars = head.size() + tail.size();
+        if (!segment_matches(str.data(), head) ||
+            !segment_matches(str.data() + str.size() - tail.size(), tail))
+            return result(false);
+
+        // Segments between first and last * can take any place in the rest.
+        std::string_view rest = str.substr(head.size(), str.size() -
+                                           head.size() - tail.size());
+        std::size_t segment_start = first_star + 1;
+        while (segment_start < last_star)
+        {
+            std::size_t segment_end = pattern.find('*', segment_start);
+            std::string_view segment = pattern.substr(
+                segment_start, segment_end - segment_start);
+            segment_start = segment_end + 1;
+
+            if (segment.empty())
+                continue;
+
+            std::size_t pos = find_segment(rest, segment, chars, backtracks);
+            if (pos == std::string_view::npos)
+                return result(false);
+            rest.remove_prefix(pos + segment.size());
+        }
+
+        return result(true);
+    }
+};
+
+// Queries are implemented by college_state, which has to be complete before
+// their return types can be deduced.
+inline auto College::find_courses(const std::string &pattern) const
+{
+    measured_call call(*this, CollegeMetrics::find_courses);
+    std::shared_lock lock(locks.structure);
+
+    auto compute = [&]()
+    {
+        auto pool = scan_pool_for(state->course_names.size());
+        return state->find_courses(pattern, std::pmr::get_default_resource(),
+                                   pool.get());
+    };
+    auto result = has_wildcards(pattern) ?
+        cached_query(query_key('c', pattern), compute) : compute();
+    call.set_results(result.size());
+    return result;
+}
+
+template <IsAcademic T>
+auto College::find(const std::string &name_pattern,
+                   const std::string &surname_pattern) const
+{
+    measured_call call(*this, CollegeMetrics::find_people);
+    std::shared_lock lock(locks.structure);
+
+    auto compute = [&]()
+    {
+        auto pool = scan_pool_for(state->people_names.size());
+        return state->find<T>(name_pattern, surname_pattern,
+                              std::pmr::get_default_resource(), pool.get());
+    };
+    auto result = has_wildcards(name_pattern) ||
+        has_wildcards(surname_pattern) ? cached_query(query_key(
+            type_code<T>(), name_pattern, surname_pattern), compute) :
+        compute();
+    call.set_results(result.size());
+    return result;
+}
+
+inline auto College::find_courses(const std::string &pattern,
+                                  std::pmr::memory_resource *scratch) const
+{
+    measured_call call(*this, CollegeMetrics::find_courses);
+    std::shared_lock lock(locks.structure);
+
+    auto pool = scan_pool_for(state->course_names.size());
+    auto result = state->find_courses(pattern, scratch, pool.get());
+    call.set_results(result.size());
+    return result;
+}
+
+template <IsAcademic T>
+auto College::find(const std::string &name_pattern,
+                   const std::string &surname_pattern,
+                   std::pmr::memory_resource *scratch) const
+{
+    measured_call call(*this, CollegeMetrics::find_people);
+    std::shared_lock lock(locks.structure);
+
+    auto pool = scan_pool_for(state->people_names.size());
+    auto result = state->find<T>(name_pattern, surname_pattern, scratch,
+                                 pool.get());
+    call.set_results(result.size());
+    return result;
+}
+
+// Compile-time patterns share keys of cached results with the same patterns
+// given at run time, results are the same.
+template <FixedPattern pattern>
+auto College::find_courses() const
+{
+    using matcher = static_matcher<pattern>;
+
+    measured_call call(*this, CollegeMetrics::find_courses);
+    std::shared_lock lock(locks.structure);
+
+    auto compute = [&]()
+    {
+        auto pool = scan_pool_for(state->course_names.size());
+        return state->find_courses<matcher>(
+            matcher::pattern, std::pmr::get_default_resource(), pool.get());
+    };
+    auto result = [&]()
+    {
+        if constexpr (matcher::exact())
+            return compute();
+        else
+            return cached_query(query_key('c', matcher::pattern), compute);
+    }();
+    call.set_results(result.size());
+    return result;
+}
+
+template <IsAcademic T, FixedPattern name_pattern,
+          FixedPattern surname_pattern>
+auto College::find() const
+{
+    using name_matcher = static_matcher<name_pattern>;
+    using surname_matcher = static_matcher<surname_pattern>;
+
+    measured_call call(*this, CollegeMetrics::find_people);
+    std::shared_lock lock(locks.structure);
+
+    auto compute = [&]()
+    {
+        auto pool = scan_pool_for(state->people_names.size());
+        return state->find<T, name_matcher, surname_matcher>(
+            name_matcher::pattern, surname_matcher::pattern,
+            std::pmr::get_default_resource(), pool.get());
+    };
+    auto result = [&]()
+    {
+        if constexpr (name_matcher::exact() && surname_matcher::exact())
+            return compute();
+        else
+            return cached_query(query_key(type_code<T>(),
+                                          name_matcher::pattern,
+                                          surname_matcher::pattern), compute);
+    }();
+    call.set_results(result.size());
+    return result;
+}
+
+// Specializations:
+// We need add_person specialization cause constructors may differ, and in some
+// of them we need to add active, whereas in others we don't.
+template <>
+inline bool College::add_person<Student>(const std::string &name, 
+    const std::string &surname, bool active)
+{
+    measured_call call(*this, CollegeMetrics::add_person);
+    logged_call logged(*this);
+
+    std::unique_lock lock(locks.structure);
+
+    if (state->people_names.find(person_key(name, surname)) ==
+        state->people_names.end())
+    {
+        unshare_state();
+        state->add_person(make_person<Student>(name, surname, active));
+        logged.record(log_format::add_person, log_format::role<Student>(),
+                      active, name, surname);
+        bump_version();
+        logged.commit(lock);
+        return true;
+    }
+    return false;
+}
+
+template <>
+inline bool College::add_person<Teacher>(const std::string &name, 
+    const std::string &surname, bool active)
+{
+    measured_call call(*this, CollegeMetrics::add_person);
+    logged_call logged(*this);
+
+    active = true;
+    std::unique_lock lock(locks.structure);
+
+    if (state->people_names.find(person_key(name, surname)) ==
+        state->people_names.end())
+    {
+        unshare_state();
+        state->add_person(make_person<Teacher>(name, surname, true));
+        logged.record(log_format::add_person, log_format::role<Teacher>(),
+                      true, name, surname);
+        bump_version();
+
+        logged.commit(lock);
+        return active;
+    }
+    return false;
+}
+
+template <>
+inline bool College::add_person<PhDStudent>(const std::string &name, 
+    const std::string &surname, bool active)
+{
+    measured_call call(*this, CollegeMetrics::add_person);
+    logged_call logged(*this);
+
+    std::unique_lock lock(locks.structure);
+
+    if (state->people_names.find(person_key(name, surname)) ==
+        state->people_names.end())
+    {
+        unshare_state();
+        state->add_person(make_person<PhDStudent>(name, surname, active));
+        logged.record(log_format::add_person, log_format::role<PhDStudent>(),
+                      active, name, surname);
+        bump_version();
+        logged.commit(lock);
+        return true;
+    }
+    return false;
+}
+
+// We need assign_course specializations, because PhDStudent is both a teacher
+// and a student, and we need to assign the given course to the correct
+// data structure based on the specialized type.
+template <>
+inline bool College::assign_course<Student>(
+    const std::shared_ptr<Student> &person, 
+    const std::shared_ptr<Course> &course)
+{
+    measured_call call(*this, CollegeMetrics::assign_course);
+    logged_call logged(*this);
+
+    auto lock = lock_unshared_state(course.get(), person.get());
+
+    if (!state->has_person(person))
+        throw non_existing_person_exception();
+    else if (!state->has_course(course))
+        throw non_existing_course_exception();
+
+    // Activeness of course is changed under lock of its shard, so it can't
+    // change between the check and the assignment.
+    auto entities_lock = locks.lock_entities(person.get(), course.get());
+
+    if (!course->is_active())
+        throw inactive_course_exception();
+
+    if (!person->is_active())
+        throw inactive_student_exception();
+
+    if (!state->add_assignment<Student>(person->id, course->id))
+        return false;
+    else
+    {
+        person->subjects_I_attend.emplace(course);
+        auto &students = state->unshared_roster(course->id).students;
+        students.emplace(person);
+        state->students_changed(state->courses_by_id[course->id],
+                                students.size() - 1);
+        logged.record(log_format::assign, file_format::attends,
+                      person->get_name(), person->get_surname(),
+                      course->get_name());
+        bump_version();
+        logged.commit(entities_lock, lock);
+        return true;
+    }
+
+    return false;
+}
+
+template <>
+inline bool College::assign_course<Teacher>(
+    const std::shared_ptr<Teacher> &person,
+    const std::shared_ptr<Course> &course)
+{
+    measured_call call(*this, CollegeMetrics::assign_course);
+    logged_call logged(*this);
+
+    auto lock = lock_unshared_state(course.get(), person.get());
+
+    if (!state->has_person(person))
+        throw non_existing_person_exception();
+    else if (!state->has_course(course))
+        throw non_existing_course_exception();
+
+    // Activeness of course is changed under lock of its shard, so it can't
+    // change between the check and the assignment.
+    auto entities_lock = locks.lock_entities(person.get(), course.get());
+
+    if (!course->is_active())
+        throw inactive_course_exception();
+
+    if (!state->add_assignment<Teacher>(person->id, course->id))
         return false;
     else
     {
-        person->subjects_I_attend.emplace(course);
-        person->subjects_I_attend_const.emplace(course);
-        return true;
+        person->subjects_I_handle.emplace(course);
+        state->unshared_roster(course->id).teachers.emplace(person);
+        logged.record(log_format::assign, file_format::handles,
+                      person->get_name(), person->get_surname(),
+                      course->get_name());
+        bump_version();
+        logged.commit(entities_lock, lock);
+        return true;
+    }
+
+    return false;
+}
+
+template <StudentTeacher T>
+bool College::assign_course(person_id person, course_id course)
+{
+    measured_call call(*this, CollegeMetrics::assign_course);
+    logged_call logged(*this);
+
+    auto lock = lock_unshared_state(std::optional<course_id>(course),
+                                    std::optional<person_id>(person));
+    const person_entry *person_entry = state->person_at(person);
+    const course_entry *course_entry = state->course_at(course);
+
+    if (person_entry == nullptr || !person_entry->has_role<T>())
+        throw non_existing_person_exception();
+    else if (course_entry == nullptr)
+        throw non_existing_course_exception();
+
+    T *member = person_entry->get<T>();
+    const auto &course_ptr = course_entry->course;
+
+    // The same order of locking and checks as in assign_course above.
+    auto entities_lock = locks.lock_entities(member, course_ptr.get());
+    if (!course_ptr->is_active())
+        throw inactive_course_exception();
+
+    if constexpr (std::same_as<T, Student>)
+    {
+        if (!member->is_active())
+            throw inactive_student_exception();
+    }
+
+    if (!state->template add_assignment<T>(person, course))
+        return false;
+
+    courses_of(*member).emplace(course_ptr);
+
+    state->unshared_roster(course).members<T>().emplace(
+        person_entry->person);
+    if constexpr (std::same_as<T, Student>)
+        state->students_changed(*course_entry,
+                                course_entry->roster->students.size() - 1);
+    logged.record(log_format::assign, log_format::kind<T>(),
+                  member->get_name(), member->get_surname(),
+                  course_ptr->get_name());
+    bump_version();
+    logged.commit(entities_lock, lock);
+    return true;
+}
+
+template <typename T, std::ranges::input_range R>
+    requires IsAcademic<T> && (!std::same_as<T, Person>)
+std::vector<bool> College::add_people(R &&people, bool active)
+{
+    measured_call call(*this, CollegeMetrics::add_people);
+
+    // Names are copied first, since range can be readable only once.
+    std::vector<std::pair<std::string, std::string>> names;
+    for (auto &&[name, surname] : people)
+        names.emplace_back(std::string(name), std::string(surname));
+    call.set_results(names.size());
+
+    std::vector<bool> added(names.size(), false);
+    if (names.empty())
+        return added;
+
+    auto order = sorted_order(names, std::less<>());
+
+    logged_call logged(*this);
+    std::unique_lock lock(locks.structure);
+    unshare_state();
+
+    bool changed = false;
+    for (std::size_t i : order)
+    {
+        person_key key(names[i].first, names[i].second);
+        auto pos = insert_position(state->people_names, key);
+        if (pos != state->people_names.end() && pos->first == key)
+            continue;
+
+        state->add_person(make_person<T>(names[i].first, names[i].second,
+                                         active), pos);
+        logged.record(log_format::add_person, log_format::role<T>(),
+                      active, names[i].first, names[i].second);
+        added[i] = changed = true;
+    }
+
+    if (changed)
+        bump_version();
+
+    logged.commit(lock);
+    return added;
+}
+
+template <std::ranges::input_range R>
+std::vector<bool> College::add_courses(R &&names, bool active)
+{
+    measured_call call(*this, CollegeMetrics::add_courses);
+
+    std::vector<std::string> course_names;
+    for (auto &&name : names)
+        course_names.emplace_back(name);
+    call.set_results(course_names.size());
+
+    std::vector<bool> added(course_names.size(), false);
+    if (course_names.empty())
+        return added;
+
+    auto order = sorted_order(course_names, std::less<>());
+
+    logged_call logged(*this);
+    std::unique_lock lock(locks.structure);
+    unshare_state();
+
+    bool changed = false;
+    for (std::size_t i : order)
+    {
+        std::string_view name = course_names[i];
+        auto pos = insert_position(state->course_names, name);
+        if (pos != state->course_names.end() && pos->first == name)
+            continue;
+
+        state->add_course(make_course(course_names[i], active),
+                          pos);
+        logged.record(log_format::add_course, name, active);
+        added[i] = changed = true;
+    }
+
+    if (changed)
+        bump_version();
+
+    logged.commit(lock);
+    return added;
+}
+
+template <StudentTeacher T, std::ranges::input_range R>
+std::vector<bool> College::assign_course(
+    R &&people, const std::shared_ptr<Course> &course)
+{
+    measured_call call(*this, CollegeMetrics::assign_course_batch);
+
+    std::vector<std::shared_ptr<T>> members;
+    for (auto &&person : people)
+        members.emplace_back(person);
+    call.set_results(members.size());
+
+    logged_call logged(*this);
+    std::unique_lock lock(locks.structure);
+
+    // The same checks (and in the same order) as in assign_course.
+    for (const auto &person : members)
+        if (!state->has_person(person))
+            throw non_existing_person_exception();
+    if (!state->has_course(course))
+        throw non_existing_course_exception();
+    if (!course->is_active())
+        throw inactive_course_exception();
+    if constexpr (std::same_as<T, Student>)
+        for (const auto &person : members)
+            if (!person->is_active())
+                throw inactive_student_exception();
+
+    std::vector<bool> assigned(members.size(), false);
+    if (members.empty())
+        return assigned;
+
+    unshare_state();
+    course_roster &course_members = state->unshared_roster(course->id);
+    roster_set &roster = course_members.template members<T>();
+    std::size_t students_before = course_members.students.size();
+
+    // People are inserted in order of roster, so each one goes right after
+    // the previous one (at the end of new roster) without search.
+    auto order = sorted_order(members, Person::people_cmp());
+    auto hint = roster.begin();
+    bool changed = false;
+
+    for (std::size_t i : order)
+    {
+        if (!state->template add_assignment<T>(members[i]->id,
+                                                  course->id))
+            continue;
+
+        courses_of<T>(*members[i]).emplace(course);
+
+        hint = std::next(roster.emplace_hint(hint, members[i]));
+        logged.record(log_format::assign, log_format::kind<T>(),
+                      members[i]->get_name(), members[i]->get_surname(),
+                      course->get_name());
+        assigned[i] = changed = true;
+    }
+
+    state->students_changed(state->courses_by_id[course->id],
+                            students_before);
+    if (changed)
+        bump_version();
+
+    logged.commit(lock);
+    return assigned;
+}
+
+template <StudentTeacher T, std::ranges::input_range R>
+std::vector<bool> College::assign_course(const std::shared_ptr<T> &person,
+                                         R &&courses)
+{
+    measured_call call(*this, CollegeMetrics::assign_course_batch);
+
+    std::vector<std::shared_ptr<Course>> targets;
+    for (auto &&course : courses)
+        targets.emplace_back(course);
+    call.set_results(targets.size());
+
+    logged_call logged(*this);
+    std::unique_lock lock(locks.structure);
+
+    if (!state->has_person(person))
+        throw non_existing_person_exception();
+    for (const auto &course : targets)
+        if (!state->has_course(course))
+            throw non_existing_course_exception();
+    for (const auto &course : targets)
+        if (!course->is_active())
+            throw inactive_course_exception();
+    if constexpr (std::same_as<T, Student>)
+        if (!person->is_active())
+            throw inactive_student_exception();
+
+    std::vector<bool> assigned(targets.size(), false);
+    if (targets.empty())
+        return assigned;
+
+    unshare_state();
+
+    // Courses are inserted in order of person's set, the same way as people
+    // in the other version.
+    auto &person_courses = courses_of<T>(*person);
+    auto order = sorted_order(targets, Person::my_cmp_const());
+    auto hint = person_courses.begin();
+    bool changed = false;
+
+    for (std::size_t i : order)
+    {
+        course_id id = targets[i]->id;
+        if (!state->template add_assignment<T>(person->id, id))
+            continue;
+
+        hint = std::next(person_courses.emplace_hint(hint, targets[i]));
+        state->unshared_roster(id).template members<T>().emplace(person);
+        if constexpr (std::same_as<T, Student>)
+        {
+            const course_entry &entry = state->courses_by_id[id];
+            state->students_changed(entry, entry.roster->students.size() - 1);
+        }
+        logged.record(log_format::assign, log_format::kind<T>(),
+                      person->get_name(), person->get_surname(),
+                      targets[i]->get_name());
+        assigned[i] = changed = true;
+    }
+
+    if (changed)
+        bump_version();
+
+    logged.commit(lock);
+    return assigned;
+}
+
+// We need find() specializations because PhDStudent is both a teacher
+// and a student and we want to check an appropriate part of course roster.
+template <>
+inline auto College::find<Student>(const std::shared_ptr<Course> &course)
+{
+    measured_call call(*this, CollegeMetrics::find_course_members);
+    std::shared_lock lock(locks.structure);
+
+    if (!state->has_course(course))
+        return roster_set();
+
+    // Roster can be replaced by its copy under lock of its shard.
+    std::lock_guard roster_lock(locks.shard(course.get()));
+    auto roster = state->find_roster(course);
+
+    call.set_results(roster->students.size());
+    return roster->students;
+}
+
+template <>
+inline auto College::find<Teacher>(const std::shared_ptr<Course> &course)
+{
+    measured_call call(*this, CollegeMetrics::find_course_members);
+    std::shared_lock lock(locks.structure);
+
+    if (!state->has_course(course))
+        return roster_set();
+
+    // Roster can be replaced by its copy under lock of its shard.
+    std::lock_guard roster_lock(locks.shard(course.get()));
+    auto roster = state->find_roster(course);
+
+    call.set_results(roster->teachers.size());
+    return roster->teachers;
+}
+
+/**
+ * Lazily evaluated result of College::query<T>() or College::query_courses().
+ * Scan describes which entries of college state can match and matches them
+ * one at a time. Results are shared_ptrs made only for consumed elements.
+ */
+template <typename Scan>
+class CollegeQuery
+{
+public:
+    using value_type = typename Scan::value_type;
+    // Position in results, it can be kept and used to ask for next page.
+    using cursor = typename Scan::cursor_type;
+
+    struct page_type
+    {
+        std::vector<value_type> items;
+        // Empty if there are no more results.
+        std::optional<cursor> next;
+    };
+
+    class iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = typename Scan::value_type;
+        using difference_type = std::ptrdiff_t;
+
+        value_type operator*() const
+        {
+            return Scan::value(*entry);
+        }
+
+        iterator &operator++()
+        {
+            scan->advance(pos);
+            entry = scan->match(pos);
+            return *this;
+        }
+
+        iterator operator++(int)
+        {
+            iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool operator==(std::default_sentinel_t) const noexcept
+        {
+            return entry == nullptr;
+        }
+
+    private:
+        friend class CollegeQuery;
+
+        iterator(const Scan *_scan, typename Scan::position _pos) :
+            scan(_scan), pos(_pos), entry(scan->match(pos)) {}
+
+        const Scan *scan;
+        typename Scan::position pos;
+        const typename Scan::entry_type *entry;
+    };
+
+    iterator begin() const
+    {
+        return iterator(scan, scan->start());
+    }
+
+    std::default_sentinel_t end() const noexcept
+    {
+        return std::default_sentinel;
+    }
+
+    // Function counts results without making any shared_ptr.
+    std::size_t count() const
+    {
+        std::size_t result = 0;
+        auto pos = scan->start();
+        for (; scan->match(pos) != nullptr; scan->advance(pos))
+            result++;
+        return result;
+    }
+
+    bool exists() const
+    {
+        auto pos = scan->start();
+        return scan->match(pos) != nullptr;
+    }
+
+    std::vector<value_type> first_n(std::size_t n) const
+    {
+        return page(n).items;
+    }
+
+    // Function returns up to size (> 0) results following given cursor (or
+    // the first ones, if there is no cursor) and cursor of the next page.
+    page_type page(std::size_t size,
+                   const std::optional<cursor> &after = std::nullopt) const
+    {
+        page_type result;
+
+        typename Scan::key_type after_key;
+        if (after.has_value())
+            after_key = Scan::key(*after);
+
+        auto pos = scan->start(after.has_value() ? &after_key : nullptr);
+        const typename Scan::entry_type *entry = scan->match(pos);
+        const typename Scan::entry_type *last = nullptr;
+
+        for (; entry != nullptr && result.items.size() < size;
+             scan->advance(pos), entry = scan->match(pos))
+        {
+            result.items.push_back(Scan::value(*entry));
+            last = entry;
+        }
+
+        if (entry != nullptr && last != nullptr)
+            result.next = Scan::cursor(*last);
+
+        return result;
+    }
+
+private:
+    friend class College;
+    friend class CollegeSnapshot;
+
+    // Scan refers to state and patterns, so they are kept together with it.
+    // Copies of query share them.
+    struct scan_holder
+    {
+        std::shared_ptr<const College::college_state> state;
+        std::vector<std::string> patterns;
+        std::optional<Scan> scan;
+    };
+
+    template <typename... Patterns>
+    CollegeQuery(std::shared_ptr<const College::college_state> state,
+                 const Patterns &...patterns)
+    {
+        auto new_holder = std::make_shared<scan_holder>();
+        new_holder->state = std::move(state);
+        new_holder->patterns = {patterns...};
+        make_scan(*new_holder, std::index_sequence_for<Patterns...>());
+
+        scan = &*new_holder->scan;
+        holder = std::move(new_holder);
+    }
+
+    template <std::size_t... I>
+    static void make_scan(scan_holder &new_holder, std::index_sequence<I...>)
+    {
+        new_holder.scan.emplace(*new_holder.state, new_holder.patterns[I]...);
+    }
+
+    std::shared_ptr<const scan_holder> holder;
+    const Scan *scan;
+};
+
+template <IsAcademic T>
+College::people_query<T> College::query(const std::string &name_pattern,
+    const std::string &surname_pattern) const
+{
+    measured_call call(*this, CollegeMetrics::query);
+
+    return people_query<T>(share_state(), name_pattern, surname_pattern);
+}
+
+inline College::course_query College::query_courses(
+    const std::string &pattern) const
+{
+    measured_call call(*this, CollegeMetrics::query);
+
+    return course_query(share_state(), pattern);
+}
+
+inline void College::save(const std::string &path) const
+{
+    measured_call call(*this, CollegeMetrics::save);
+
+    // Like snapshot, we keep state from the moment of call, so file is
+    // written without holding any lock.
+    write_file(*share_state(), path, 0);
+}
+
+inline void College::write_file(const college_state &saved,
+                                const std::string &path,
+                                std::uint32_t log_generation)
+{
+    if (saved.course_names.size() > UINT32_MAX ||
+        saved.people_names.size() > UINT32_MAX)
+        throw college_file_exception();
+
+    std::string payload;
+
+    for (const auto &[name, id] : saved.course_names)
+    {
+        file_format::put_string(payload, name);
+        file_format::put_uint(payload,
+                              saved.courses_by_id[id].course->is_active(), 1);
+    }
+
+    // Assignments refer to people by their position in file.
+    std::unordered_map<const Person *, std::uint64_t> person_indexes;
+    person_indexes.reserve(saved.people_names.size());
+
+    for (const auto &[key, id] : saved.people_names)
+    {
+        const person_entry &entry = saved.people_by_id[id];
+        std::uint8_t role = file_format::teacher_role;
+        if (entry.phd_student != nullptr)
+            role = file_format::phd_student_role;
+        else if (entry.student != nullptr)
+            role = file_format::student_role;
+
+        file_format::put_uint(payload, role, 1);
+        file_format::put_uint(payload,
+            entry.student == nullptr || entry.student->is_active(), 1);
+        file_format::put_string(payload, key.first);
+        file_format::put_string(payload, key.second);
+
+        person_indexes.emplace(entry.person.get(), person_indexes.size());
+    }
+
+    // Rosters are ordered the same way as our map of people, so people of
+    // every course are written in order of their indexes.
+    std::uint64_t assignment_count = 0;
+    std::uint64_t course_index = 0;
+    for (const auto &[name, id] : saved.course_names)
+    {
+        const course_roster &roster = *saved.courses_by_id[id].roster;
+        for (std::uint8_t kind : {file_format::attends, file_format::handles})
+        {
+            const roster_set &members = kind == file_format::attends ?
+                roster.students : roster.teachers;
+
+            for (const auto &person : members)
+            {
+                file_format::put_uint(payload, course_index, 4);
+                file_format::put_uint(payload, kind, 1);
+                file_format::put_uint(payload,
+                                      person_indexes.at(person.get()), 4);
+                assignment_count++;
+            }
+        }
+        course_index++;
+    }
+
+    std::string header(file_format::magic);
+    file_format::put_uint(header, file_format::format_version, 4);
+    file_format::put_uint(header, log_generation, 4);
+    file_format::put_uint(header, saved.course_names.size(), 8);
+    file_format::put_uint(header, saved.people_names.size(), 8);
+    file_format::put_uint(header, assignment_count, 8);
+    file_format::put_uint(header, payload.size(), 8);
+    file_format::put_uint(header, file_format::checksum(payload), 8);
+
+    // New file replaces old one only when it is completely written (and
+    // synced), so we never leave half of college on disk.
+    std::string tmp_path = path + ".tmp";
+    std::FILE *out = std::fopen(tmp_path.c_str(), "wb");
+    bool ok = out != nullptr &&
+        std::fwrite(header.data(), 1, header.size(), out) == header.size() &&
+        std::fwrite(payload.data(), 1, payload.size(), out) ==
+            payload.size() &&
+        sync_file(out);
+    if (out != nullptr && std::fclose(out) != 0)
+        ok = false;
+
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp_path.c_str());
+        throw college_file_exception();
+    }
+    // Renamed file isn't durable until its directory entry is synced.
+    if (!sync_directory(path))
+        throw college_file_exception();
+}
+
+inline College College::load(const std::string &path,
+                              std::pmr::memory_resource *resource)
+{
+    return load(path, resource, nullptr);
+}
+
+inline College College::load(const std::string &path,
+                              std::pmr::memory_resource *resource,
+                              std::uint32_t *log_generation)
+{
+    mapped_file file(path);
+    std::string_view data = file.data();
+
+    if (data.size() < file_format::header_size ||
+        !data.starts_with(file_format::magic))
+        throw corrupted_file_exception();
+
+    file_reader header{data.data() + file_format::magic.size(),
+                       data.data() + file_format::header_size};
+    if (header.get_uint(4) != file_format::format_version)
+        throw corrupted_file_exception();
+    std::uint64_t generation = header.get_uint(4);
+    if (log_generation != nullptr)
+        *log_generation = static_cast<std::uint32_t>(generation);
+
+    std::uint64_t course_count = header.get_uint(8);
+    std::uint64_t person_count = header.get_uint(8);
+    std::uint64_t assignment_count = header.get_uint(8);
+    std::uint64_t payload_size = header.get_uint(8);
+    std::uint64_t checksum = header.get_uint(8);
+
+    std::string_view payload = data.substr(file_format::header_size);
+    if (payload.size() != payload_size ||
+        file_format::checksum(payload) != checksum)
+        throw corrupted_file_exception();
+
+    College college(resource);
+    college_state &loaded = *college.state;
+    file_reader reader{payload.data(), payload.data() + payload.size()};
+
+    // Courses and people are stored in order of our maps, so each of them
+    // is inserted at the end. We still check the order, since file with
+    // wrong one would break our maps. Counts come from file, so vectors
+    // are not reserved for more than payload can hold.
+    std::vector<course_id> courses;
+    courses.reserve(std::min(course_count, payload_size / 5));
+
+    for (std::uint64_t i = 0; i < course_count; i++)
+    {
+        std::string_view name = reader.get_string();
+        bool active = reader.get_uint(1) != 0;
+
+        if (!loaded.course_names.empty() &&
+            loaded.course_names.back().first >= name)
+            throw corrupted_file_exception();
+
+        auto course = college.make_course(std::string(name), active);
+        courses.push_back(
+            loaded.add_course(course, loaded.course_names.end()));
     }
 
-    return false;
+    std::vector<person_id> people;
+    people.reserve(std::min(person_count, payload_size / 10));
+
+    for (std::uint64_t i = 0; i < person_count; i++)
+    {
+        std::uint64_t role = reader.get_uint(1);
+        bool active = reader.get_uint(1) != 0;
+        std::string name(reader.get_string());
+        std::string surname(reader.get_string());
+
+        if (!loaded.people_names.empty() &&
+            loaded.people_names.back().first >= person_key(name, surname))
+            throw corrupted_file_exception();
+
+        auto hint = loaded.people_names.end();
+        person_id id;
+
+        if (role == file_format::student_role)
+            id = loaded.add_person(college.make_person<Student>(
+                name, surname, active), hint);
+        else if (role == file_format::teacher_role)
+            id = loaded.add_person(college.make_person<Teacher>(
+                name, surname, true), hint);
+        else if (role == file_format::phd_student_role)
+            id = loaded.add_person(college.make_person<PhDStudent>(
+                name, surname, active), hint);
+        else
+            throw corrupted_file_exception();
+
+        people.push_back(id);
+    }
+
+    // Assignments come in order of courses, kinds and people, so both
+    // rosters and courses of every person are filled from their ends.
+    std::tuple<std::uint64_t, std::uint64_t, std::uint64_t> previous;
+
+    for (std::uint64_t i = 0; i < assignment_count; i++)
+    {
+        std::uint64_t course_index = reader.get_uint(4);
+        std::uint64_t kind = reader.get_uint(1);
+        std::uint64_t person_index = reader.get_uint(4);
+
+        std::tuple current(course_index, kind, person_index);
+        if (course_index >= courses.size() || person_index >= people.size() ||
+            (i > 0 && previous >= current))
+            throw corrupted_file_exception();
+        previous = current;
+
+        course_roster &roster = loaded.unshared_roster(courses[course_index]);
+        const auto &course =
+            loaded.courses_by_id[courses[course_index]].course;
+        const person_entry &person =
+            loaded.people_by_id[people[person_index]];
+
+        // Index is changed last, it can move entry of person.
+        if (kind == file_format::attends && person.student != nullptr)
+        {
+            roster.students.emplace_hint(roster.students.end(),
+                                         person.person);
+            person.student->subjects_I_attend.emplace_hint(
+                person.student->subjects_I_attend.end(), course);
+            loaded.add_assignment<Student>(people[person_index],
+                                           courses[course_index]);
+        }
+        else if (kind == file_format::handles && person.teacher != nullptr)
+        {
+            roster.teachers.emplace_hint(roster.teachers.end(),
+                                         person.person);
+            person.teacher->subjects_I_handle.emplace_hint(
+                person.teacher->subjects_I_handle.end(), course);
+            loaded.add_assignment<Teacher>(people[person_index],
+                                           courses[course_index]);
+        }
+        else
+            throw corrupted_file_exception();
+    }
+
+    if (reader.pos != reader.end)
+        throw corrupted_file_exception();
+
+    // Rosters were filled directly, every course was added without students.
+    for (course_id course : courses)
+        loaded.students_changed(loaded.courses_by_id[course], 0);
+
+    return college;
 }
 
-template <>
-inline bool College::assign_course<Teacher>(
-    const std::shared_ptr<Teacher> &person,
-    const std::shared_ptr<Course> &course)
+inline void College::open_log(const std::string &path,
+                              const log_options &options)
 {
-    if (!person_set.contains(person))
-        throw non_existing_person_exception();
-    else if (!course_set.contains(course))
-        throw non_existing_course_exception();
+    std::unique_lock lock(locks.structure);
 
-    if (!course->is_active())
-        throw inactive_course_exception();
+    if (logging.log != nullptr)
+        throw college_file_exception();
 
-    if (person->subjects_I_handle.contains(course))
-        return false;
+    std::string log_path = path + ".log";
+    std::string next_path = path + ".log.next";
+    // Generation of the last log college contains, and size of complete
+    // part of the current log, if it can be continued.
+    std::uint32_t generation = 0;
+    std::uint64_t log_size = 0;
+    bool saved = false;
+
+    if (!std::filesystem::exists(path))
+    {
+        // Logs left without college file don't belong to current contents.
+        std::remove(log_path.c_str());
+        std::remove(next_path.c_str());
+        write_file(*state, path, 0);
+        saved = true;
+    }
     else
     {
-        person->subjects_I_handle.emplace(course);
-        person->subjects_I_handle_const.emplace(course);
-        return true;
+        College opened = load(path, state->memory(), &generation);
+
+        // Log of compaction which didn't finish comes after the current
+        // one. Logs already compacted into college file are skipped, and
+        // log torn while it was created has no records yet.
+        for (const std::string *log : {&log_path, &next_path})
+        {
+            if (!std::filesystem::exists(*log))
+                continue;
+
+            mapped_file file(*log);
+            std::string_view data = file.data();
+            if (data.size() < log_format::header_size ||
+                !data.starts_with(log_format::magic))
+                continue;
+
+            file_reader header{data.data() + log_format::magic.size(),
+                               data.data() + log_format::header_size};
+            if (header.get_uint(4) != log_format::format_version)
+                throw corrupted_file_exception();
+            std::uint32_t log_generation =
+                static_cast<std::uint32_t>(header.get_uint(4));
+            if (log_generation <= generation)
+                continue;
+
+            std::size_t complete = log_format::header_size +
+                opened.replay_log(data.substr(log_format::header_size));
+            generation = log_generation;
+            if (log == &log_path)
+                log_size = complete;
+        }
+
+        if (state->ngrams)
+            opened.state->index_ngrams(state->ngrams->max_posting_size);
+        state = std::move(opened.state);
+        state_shared = false;
+        bump_version();
     }
 
-    return false;
+    std::FILE *file;
+    if (log_size != 0 && !std::filesystem::exists(next_path))
+    {
+        // Torn record is cut off, so new ones follow complete ones.
+        std::error_code error;
+        std::filesystem::resize_file(log_path, log_size, error);
+        file = error ? nullptr : std::fopen(log_path.c_str(), "ab");
+        if (file == nullptr || !sync_file(file))
+        {
+            if (file != nullptr)
+                std::fclose(file);
+            throw college_file_exception();
+        }
+    }
+    else
+    {
+        // Compaction interrupted by crash is finished here - college file
+        // gets everything that was replayed, and new log starts after it.
+        if (!saved)
+            write_file(*state, path, generation);
+        file = create_log(log_path, ++generation);
+        std::remove(next_path.c_str());
+        log_size = log_format::header_size;
+    }
+
+    logging.log = std::make_shared<mutation_log>(path, options, file,
+                                                 generation, log_size);
 }
 
-// We need find() specializations because PhDStudent is both a teacher
-// and a student and we want to check an appropriate data structure
-// for the given course.
-template <>
-inline auto College::find<Student>(const std::shared_ptr<Course> &course)
+template <StudentTeacher T>
+void College::replay_assignment(bool assign, const person_entry &person,
+                                course_id course)
 {
-    std::set<std::shared_ptr<Person>, Person::people_cmp> matching_people;
-    for (auto iter = person_set.begin(); iter != person_set.end();
-         ++iter)
+    auto &courses = courses_of(*person.get<T>());
+    course_roster &roster = state->unshared_roster(course);
+    const course_entry &entry = state->courses_by_id[course];
+    std::size_t students_before = roster.students.size();
+
+    person_id id = person.person->id;
+
+    if (assign)
     {
-        Student *temp = dynamic_cast<Student *>(iter->get());
-        if (temp != nullptr && temp->subjects_I_attend.contains(course))
+        if (state->add_assignment<T>(id, course))
         {
-            for (auto iter2 = temp->subjects_I_attend.begin(); 
-                iter2 != temp->subjects_I_attend.end();
-                ++iter2)
-            {
-                if ((*iter2) == course)
-                {
-                    matching_people.emplace(*iter);
-                    break;
-                }
-            }
+            courses.emplace(entry.course);
+            roster.members<T>().emplace(person.person);
         }
     }
+    else if (state->remove_assignment<T>(id, course))
+    {
+        college_state::unlink(courses, entry.course);
+        roster.members<T>().erase(person.person);
+    }
+    state->students_changed(entry, students_before);
+}
+
+inline std::size_t College::replay_log(std::string_view records)
+{
+    std::size_t complete = 0;
+
+    while (records.size() - complete >= log_format::record_header_size)
+    {
+        file_reader frame{records.data() + complete,
+                          records.data() + records.size()};
+        std::size_t size = frame.get_uint(4);
+        std::uint64_t checksum = frame.get_uint(8);
+
+        if (static_cast<std::size_t>(frame.end - frame.pos) < size)
+            break;
+        std::string_view payload(frame.pos, size);
+        if (file_format::checksum(payload) != checksum)
+            break;
+
+        // Record with correct checksum has to make sense.
+        file_reader reader{payload.data(), payload.data() + size};
+        replay_record(reader);
+        if (reader.pos != reader.end)
+            throw corrupted_file_exception();
+
+        complete += log_format::record_header_size + size;
+    }
 
-    return matching_people;
+    return complete;
 }
 
-template <>
-inline auto College::find<Teacher>(const std::shared_ptr<Course> &course)
+inline void College::replay_record(file_reader &reader)
+{
+    auto check = [](bool condition)
+    {
+        if (!condition)
+            throw corrupted_file_exception();
+    };
+    // Both return ids.
+    auto find_course = [&](std::string_view name)
+    {
+        auto iter = state->course_names.find(name);
+        check(iter != state->course_names.end());
+        return iter->second;
+    };
+    auto find_person = [&](std::string_view name, std::string_view surname)
+    {
+        auto iter = state->people_names.find(person_key(name, surname));
+        check(iter != state->people_names.end());
+        return iter->second;
+    };
+
+    std::uint64_t change = reader.get_uint(1);
+
+    switch (change)
+    {
+    case log_format::add_course:
+    {
+        std::string name(reader.get_string());
+        bool active = reader.get_uint(1) != 0;
+
+        check(!state->course_names.contains(name));
+        state->add_course(make_course(name, active));
+        break;
+    }
+    case log_format::remove_course:
+    {
+        course_id id = find_course(reader.get_string());
+        auto course = state->courses_by_id[id].course;
+
+        state->remove_course(id);
+        course->change_activeness(false);
+        break;
+    }
+    case log_format::course_active:
+    {
+        course_id id = find_course(reader.get_string());
+        set_activeness(*state->courses_by_id[id].course,
+                       reader.get_uint(1) != 0);
+        break;
+    }
+    case log_format::add_person:
+    {
+        std::uint64_t role = reader.get_uint(1);
+        bool active = reader.get_uint(1) != 0;
+        std::string name(reader.get_string());
+        std::string surname(reader.get_string());
+
+        check(!state->people_names.contains(person_key(name, surname)));
+        if (role == file_format::student_role)
+            state->add_person(make_person<Student>(name, surname, active));
+        else if (role == file_format::teacher_role)
+            state->add_person(make_person<Teacher>(name, surname, true));
+        else if (role == file_format::phd_student_role)
+            state->add_person(make_person<PhDStudent>(name, surname,
+                                                      active));
+        else
+            throw corrupted_file_exception();
+        break;
+    }
+    case log_format::remove_person:
+    {
+        std::string_view name = reader.get_string();
+        std::string_view surname = reader.get_string();
+
+        state->remove_person(find_person(name, surname));
+        break;
+    }
+    case log_format::student_active:
+    {
+        std::string_view name = reader.get_string();
+        std::string_view surname = reader.get_string();
+        Student *student =
+            state->people_by_id[find_person(name, surname)].student;
+
+        check(student != nullptr);
+        set_activeness(*student, reader.get_uint(1) != 0);
+        break;
+    }
+    case log_format::assign:
+    case log_format::unassign:
+    {
+        std::uint64_t kind = reader.get_uint(1);
+        std::string_view name = reader.get_string();
+        std::string_view surname = reader.get_string();
+        // Unshared, so that replayed assignment changes it in place.
+        const person_entry &person =
+            state->people_by_id.unshared(find_person(name, surname));
+        course_id course = find_course(reader.get_string());
+        bool assign = change == log_format::assign;
+
+        if (kind == file_format::attends && person.student != nullptr)
+            replay_assignment<Student>(assign, person, course);
+        else if (kind == file_format::handles && person.teacher != nullptr)
+            replay_assignment<Teacher>(assign, person, course);
+        else
+            throw corrupted_file_exception();
+        break;
+    }
+    default:
+        throw corrupted_file_exception();
+    }
+}
+
+inline College::import_report College::bulk_import(
+    std::istream &in, const import_options &options)
+{
+    measured_call call(*this, CollegeMetrics::bulk_import);
+    // Whole import waits for one sync at the end.
+    logged_call logged(*this);
+    import_report report;
+    std::size_t batch_size = std::max<std::size_t>(options.batch_size, 1);
+
+    std::vector<import_row> batch;
+    std::vector<import_error> errors;
+    batch.reserve(std::min<std::size_t>(batch_size, 4096));
+
+    // Errors of a batch are reported in order of lines.
+    auto flush = [&]()
+    {
+        if (!batch.empty())
+            import_batch(batch, errors, report.imported, logged);
+        batch.clear();
+
+        std::sort(errors.begin(), errors.end(),
+                  [](const import_error &a, const import_error &b)
+                  {
+                      return a.line < b.line;
+                  });
+
+        report.failed += errors.size();
+        for (auto &error : errors)
+            if (report.errors.size() < options.max_errors)
+                report.errors.push_back(std::move(error));
+        errors.clear();
+    };
+
+    std::string line;
+    import_fields fields;
+    std::size_t line_number = 0;
+    bool first_row = true;
+
+    while (std::getline(in, line))
+    {
+        line_number++;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.find_first_not_of(" \t") == std::string::npos)
+            continue;
+
+        const char *error = options.format == import_format::csv ?
+            parse_csv_row(line, fields) : parse_json_row(line, fields);
+
+        // Header of CSV dump can only be its first non-empty line, later
+        // lines like it are rows with invalid type.
+        bool header = first_row && error == nullptr &&
+            options.format == import_format::csv &&
+            fields[0] == import_row::field_names[0];
+        first_row = false;
+        if (header)
+            continue;
+
+        report.rows++;
+
+        import_row row;
+        row.line = line_number;
+        if (error == nullptr)
+            error = make_import_row(fields, row);
+
+        if (error != nullptr)
+            errors.push_back(import_error{line_number, error});
+        else
+            batch.push_back(std::move(row));
+
+        if (batch.size() + errors.size() >= batch_size)
+            flush();
+    }
+    flush();
+
+    call.set_results(report.imported);
+    logged.commit();
+    return report;
+}
+
+inline void College::import_batch(std::vector<import_row> &batch,
+                                  std::vector<import_error> &errors,
+                                  std::size_t &imported, logged_call &logged)
 {
-    std::set<std::shared_ptr<Person>, Person::people_cmp> matching_people;
+    std::vector<import_row *> courses, people, assignments;
+    for (auto &row : batch)
+    {
+        if (row.type == import_type::course)
+            courses.push_back(&row);
+        else if (row.type == import_type::attends ||
+                 row.type == import_type::handles)
+            assignments.push_back(&row);
+        else
+            people.push_back(&row);
+    }
+
+    // Sorting is stable, so when row is repeated in batch, the first one is
+    // imported and the others are reported as duplicates.
+    std::stable_sort(courses.begin(), courses.end(),
+                     [](const import_row *a, const import_row *b)
+                     {
+                         return a->course < b->course;
+                     });
+    std::stable_sort(people.begin(), people.end(),
+                     [](const import_row *a, const import_row *b)
+                     {
+                         return person_key(a->name, a->surname) <
+                             person_key(b->name, b->surname);
+                     });
+    // Assignments of one course are next to each other, so course is found
+    // (and its roster copied from snapshots) once for all of them.
+    std::stable_sort(assignments.begin(), assignments.end(),
+                     [](const import_row *a, const import_row *b)
+                     {
+                         return std::tie(a->course, a->type, a->name,
+                                         a->surname) <
+                             std::tie(b->course, b->type, b->name, b->surname);
+                     });
+
+    auto fail = [&](const import_row *row, const char *message)
+    {
+        errors.push_back(import_error{row->line, message});
+    };
+
+    std::unique_lock lock(locks.structure);
+    unshare_state();
+    std::size_t imported_before = imported;
+
+    for (const import_row *row : courses)
+    {
+        auto pos = insert_position(state->course_names,
+                                   std::string_view(row->course));
+        if (pos != state->course_names.end() && pos->first == row->course)
+        {
+            fail(row, "Course already exists.");
+            continue;
+        }
+
+        state->add_course(make_course(row->course, row->active),
+                          pos);
+        logged.record(log_format::add_course, row->course, row->active);
+        imported++;
+    }
+
+    for (const import_row *row : people)
+    {
+        person_key key(row->name, row->surname);
+        auto pos = insert_position(state->people_names, key);
+        if (pos != state->people_names.end() && pos->first == key)
+        {
+            fail(row, "Person already exists.");
+            continue;
+        }
+
+        std::uint8_t role = log_format::role<PhDStudent>();
+        if (row->type == import_type::student)
+        {
+            state->add_person(make_person<Student>(row->name,
+                row->surname, row->active), pos);
+            role = log_format::role<Student>();
+        }
+        else if (row->type == import_type::teacher)
+        {
+            state->add_person(make_person<Teacher>(row->name,
+                row->surname, true), pos);
+            role = log_format::role<Teacher>();
+        }
+        else
+            state->add_person(make_person<PhDStudent>(row->name,
+                row->surname, row->active), pos);
+        logged.record(log_format::add_person, role, row->active, row->name,
+                      row->surname);
+        imported++;
+    }
+
+    const course_entry *entry = nullptr;
+    course_roster *roster = nullptr;
 
-    for (auto iter = person_set.begin(); iter != person_set.end(); ++iter)
+    for (const import_row *row : assignments)
     {
-        Teacher *temp = dynamic_cast<Teacher *>(iter->get());
-        if (temp != nullptr && temp->subjects_I_handle.contains(course))
+        if (roster == nullptr || entry->course->get_name() != row->course)
         {
-            for (auto iter2 = temp->subjects_I_handle.begin();
-                iter2 != temp->subjects_I_handle.end();
-                ++iter2)
+            auto iter = state->course_names.find(row->course);
+            roster = nullptr;
+            if (iter != state->course_names.end())
             {
-                if ((*iter2) == course)
-                {
-                    matching_people.emplace(*iter);
-                    break;
-                }
+                roster = &state->unshared_roster(iter->second);
+                entry = &state->courses_by_id[iter->second];
+            }
+        }
+
+        if (roster == nullptr)
+        {
+            fail(row, "Non-existing course.");
+            continue;
+        }
+
+        const auto &course = entry->course;
+        auto person_iter = state->people_names.find(
+            person_key(row->name, row->surname));
+        // Unshared, so that assignment changes it in place.
+        const person_entry *person =
+            person_iter == state->people_names.end() ? nullptr :
+            &state->people_by_id.unshared(person_iter->second);
+
+        if (person == nullptr)
+            fail(row, "Non-existing person.");
+        else if (!course->is_active())
+            fail(row, "Incorrect operation on an inactive course.");
+        else if (row->type == import_type::attends)
+        {
+            Student *student = person->student;
+            if (student == nullptr)
+                fail(row, "Person is not a student.");
+            else if (!student->is_active())
+                fail(row, "Incorrect operation for an inactive student.");
+            else if (!state->add_assignment<Student>(
+                         person->person->id, course->id))
+                fail(row, "Course already assigned.");
+            else
+            {
+                student->subjects_I_attend.emplace(course);
+                roster->students.emplace_hint(roster->students.end(),
+                                              person->person);
+                state->students_changed(*entry,
+                                        roster->students.size() - 1);
+                logged.record(log_format::assign, file_format::attends,
+                              row->name, row->surname, row->course);
+                imported++;
+            }
+        }
+        else
+        {
+            Teacher *teacher = person->teacher;
+            if (teacher == nullptr)
+                fail(row, "Person is not a teacher.");
+            else if (!state->add_assignment<Teacher>(
+                         person->person->id, course->id))
+                fail(row, "Course already assigned.");
+            else
+            {
+                teacher->subjects_I_handle.emplace(course);
+                roster->teachers.emplace_hint(roster->teachers.end(),
+                                              person->person);
+                logged.record(log_format::assign, file_format::handles,
+                              row->name, row->surname, row->course);
+                imported++;
             }
         }
     }
 
-    return matching_people;
+    if (imported != imported_before)
+        bump_version();
+}
+
+/**
+ * Immutable view of college at some version, returned by College::snapshot().
+ * It has the same const queries as College, but they take no locks - nobody
+ * modifies state kept by snapshot, college copies it before any change.
+ */
+class CollegeSnapshot
+{
+public:
+    std::uint64_t get_version() const noexcept
+    {
+        return version;
+    }
+
+    auto find_courses(const std::string &pattern) const
+    {
+        return state->find_courses(pattern);
+    }
+
+    template <IsAcademic T>
+    auto find(const std::string &name_pattern,
+              const std::string &surname_pattern) const
+    {
+        return state->find<T>(name_pattern, surname_pattern);
+    }
+
+    std::vector<College::course_id> find_course_ids(
+        const std::string &pattern) const
+    {
+        return state->find_course_ids(pattern);
+    }
+
+    template <IsAcademic T>
+    std::vector<College::person_id> find_ids(
+        const std::string &name_pattern,
+        const std::string &surname_pattern) const
+    {
+        return state->find_ids<T>(name_pattern, surname_pattern);
+    }
+
+    template <StudentTeacher T>
+    std::vector<College::person_id> find_ids(College::course_id course) const
+    {
+        auto entry = state->course_at(course);
+
+        if (entry == nullptr)
+            return {};
+
+        return College::member_ids(entry->roster->members<T>());
+    }
+
+    template <FixedPattern pattern>
+    auto find_courses() const
+    {
+        using matcher = College::static_matcher<pattern>;
+
+        return state->find_courses<matcher>(matcher::pattern);
+    }
+
+    template <IsAcademic T, FixedPattern name_pattern,
+              FixedPattern surname_pattern>
+    auto find() const
+    {
+        using name_matcher = College::static_matcher<name_pattern>;
+        using surname_matcher = College::static_matcher<surname_pattern>;
+
+        return state->find<T, name_matcher, surname_matcher>(
+            name_matcher::pattern, surname_matcher::pattern);
+    }
+
+    template <StudentTeacher T>
+    auto find(const std::shared_ptr<Course> &course) const
+    {
+        auto roster = state->find_roster(course);
+
+        if (roster == nullptr)
+            return College::roster_set();
+
+        return roster->members<T>();
+    }
+
+    // Aggregates as they were when snapshot was taken.
+    std::size_t count_active_students() const noexcept
+    {
+        return state->active_students.load(std::memory_order_relaxed);
+    }
+
+    std::size_t count_active_courses() const noexcept
+    {
+        return state->active_courses.load(std::memory_order_relaxed);
+    }
+
+    template <StudentTeacher T>
+    std::size_t count(const std::shared_ptr<Course> &course) const noexcept
+    {
+        auto roster = state->find_roster(course);
+        return roster == nullptr ? 0 : roster->members<T>().size();
+    }
+
+    std::vector<College::course_enrollment> top_courses(std::size_t k) const
+    {
+        return state->top_courses(k);
+    }
+
+    template <IsAcademic T>
+    College::people_query<T> query(const std::string &name_pattern,
+                                   const std::string &surname_pattern) const
+    {
+        return College::people_query<T>(state, name_pattern, surname_pattern);
+    }
+
+    College::course_query query_courses(const std::string &pattern) const
+    {
+        return College::course_query(state, pattern);
+    }
+
+private:
+    friend class College;
+
+    CollegeSnapshot(std::shared_ptr<const College::college_state> _state,
+                    std::uint64_t _version) : state(std::move(_state)),
+                                              version(_version) {}
+
+    std::shared_ptr<const College::college_state> state;
+    std::uint64_t version;
+};
+
+inline CollegeSnapshot College::snapshot() const
+{
+    measured_call call(*this, CollegeMetrics::snapshot);
+
+    // Version read before state can only be older than its contents.
+    std::uint64_t current_version = get_version();
+    return CollegeSnapshot(share_state(), current_version);
 }
 
 #endif
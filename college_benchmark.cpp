@@ -0,0 +1,702 @@
+/**
+ * Benchmark of College operations on synthetic data.
+ *
+ * Build: g++ -std=c++20 -O2 -pthread college_benchmark.cpp -o college_benchmark
+ * Run:   ./college_benchmark [--sizes 1000,10000,100000] [--queries 200]
+ *                            [--threads 8] [--seed 42] [--budget-ms 2000]
+ *
+ * For every size N we build college of N people (80% students, 15% teachers,
+ * 5% PhD students) and N / 20 courses. First names follow Zipf distribution
+ * (few very popular names), surnames are unique and end with typical
+ * suffixes, students attend 4 courses chosen with Zipf skew (few very big
+ * courses). Then we measure single operations, concurrent readers and
+ * changes synced by log of changes (in temporary directory).
+ *
+ * Result is one JSON document on stdout (progress goes to stderr):
+ * {"seed": .., "results": [{"size": N, "peak_rss_kb": .., "build_rss_kb": ..,
+ *   "bytes_per_entity": .., "operations": [{"name": .., "ops": ..,
+ *   "ops_per_sec": .., "p50_ns": .., "p99_ns": ..}, ...]}]}
+ * Sizes are run in increasing order, so peak RSS of a size is the peak of
+ * the process after it. Every operation is timed separately (clock reads cost
+ * some tens of ns, which matters only for the cheapest operations).
+ */
+
+#include "college.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+
+using bench_clock = std::chrono::steady_clock;
+
+struct options
+{
+    std::vector<std::size_t> sizes{1000, 10000, 100000};
+    std::size_t queries = 200;
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::uint64_t seed = 42;
+    std::chrono::milliseconds budget{2000};
+};
+
+// Latencies of one operation. Only up to max_samples of them are kept
+// (every n-th one), ops/s is computed from all of them.
+class op_stats
+{
+public:
+    static constexpr std::size_t max_samples = 1 << 20;
+
+    op_stats(std::string _name, std::size_t expected_ops) :
+        name(std::move(_name)),
+        stride(std::max<std::size_t>(1, expected_ops / max_samples)) {}
+
+    void add(std::chrono::nanoseconds latency)
+    {
+        if (ops++ % stride == 0)
+            samples.push_back(latency.count());
+        total += latency;
+    }
+
+    std::string to_json() const
+    {
+        std::vector<std::int64_t> sorted(samples);
+        std::sort(sorted.begin(), sorted.end());
+
+        auto percentile = [&](double p) -> std::int64_t
+        {
+            if (sorted.empty())
+                return 0;
+            auto index = static_cast<std::size_t>(p * (sorted.size() - 1));
+            return sorted[index];
+        };
+
+        double seconds = std::chrono::duration<double>(total).count();
+        std::ostringstream out;
+        out << "{\"name\": \"" << name << "\", \"ops\": " << ops
+            << ", \"ops_per_sec\": " << (seconds > 0 ? ops / seconds : 0)
+            << ", \"p50_ns\": " << percentile(0.5)
+            << ", \"p99_ns\": " << percentile(0.99) << "}";
+        return out.str();
+    }
+
+private:
+    std::string name;
+    std::size_t stride;
+    std::size_t ops = 0;
+    std::chrono::nanoseconds total{0};
+    std::vector<std::int64_t> samples;
+};
+
+// Throughput of many threads, there are no per-operation latencies.
+struct throughput_stats
+{
+    std::string name;
+    std::size_t threads;
+    std::size_t ops;
+    double seconds;
+
+    std::string to_json() const
+    {
+        std::ostringstream out;
+        out << "{\"name\": \"" << name << "\", \"threads\": " << threads
+            << ", \"ops\": " << ops << ", \"ops_per_sec\": "
+            << (seconds > 0 ? ops / seconds : 0) << "}";
+        return out.str();
+    }
+};
+
+long peak_rss_kb()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+// Current RSS (Linux only, 0 elsewhere).
+long current_rss_kb()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    std::ifstream statm("/proc/self/statm");
+    long pages = 0, resident = 0;
+    if (!(statm >> pages >> resident))
+        return 0;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#else
+    return 0;
+#endif
+}
+
+// Zipf distribution over [0, n) - rank 0 is the most popular one.
+class zipf_distribution
+{
+public:
+    zipf_distribution(std::size_t n, double s)
+    {
+        cumulative.reserve(n);
+        double sum = 0;
+        for (std::size_t i = 1; i <= n; i++)
+            cumulative.push_back(sum += 1.0 / std::pow(double(i), s));
+    }
+
+    template <typename Rng>
+    std::size_t operator()(Rng &rng) const
+    {
+        std::uniform_real_distribution<double> dist(0, cumulative.back());
+        return std::lower_bound(cumulative.begin(), cumulative.end(),
+                                dist(rng)) - cumulative.begin();
+    }
+
+private:
+    std::vector<double> cumulative;
+};
+
+const std::vector<std::string> syllables{
+    "an", "ber", "ca", "da", "el", "fi", "go", "ha", "ir", "jo", "ka", "li",
+    "ma", "no", "ol", "pa", "ra", "si", "ta", "ul", "va", "we", "zy", "mi"};
+
+const std::vector<std::string> surname_suffixes{
+    "ski", "son", "er", "ova", "ez", "ak", "wicz", "man"};
+
+const std::vector<std::string> subjects{
+    "Algebra", "Biology", "Chemistry", "Databases", "Economics", "French",
+    "Geometry", "History", "Informatics", "Journalism", "Logic", "Music",
+    "Neurobiology", "Optics", "Physics", "Statistics"};
+
+std::string capitalized(std::string str)
+{
+    if (!str.empty())
+        str[0] = static_cast<char>(std::toupper(str[0]));
+    return str;
+}
+
+// Surname built from digits of index in mixed radix (syllables and suffix),
+// so all surnames are different.
+std::string make_surname(std::size_t index)
+{
+    std::string surname;
+    std::size_t rest = index;
+    do
+    {
+        surname += syllables[rest % syllables.size()];
+        rest /= syllables.size();
+    } while (rest > 0);
+
+    return capitalized(surname +
+        surname_suffixes[index % surname_suffixes.size()]);
+}
+
+struct person_data
+{
+    enum role_type { student, teacher, phd_student } role;
+    std::string name;
+    std::string surname;
+    bool active;
+};
+
+struct dataset
+{
+    std::vector<person_data> people;
+    std::vector<std::string> courses;
+    // (person index, course index) pairs.
+    std::vector<std::pair<std::size_t, std::size_t>> attends;
+    std::vector<std::pair<std::size_t, std::size_t>> handles;
+};
+
+dataset generate(std::size_t size, std::mt19937_64 &rng)
+{
+    dataset data;
+
+    std::vector<std::string> first_names;
+    for (std::size_t i = 0; i < 2000; i++)
+        first_names.push_back(capitalized(syllables[rng() % syllables.size()] +
+            syllables[rng() % syllables.size()] +
+            (i % 3 == 0 ? syllables[rng() % syllables.size()] : "")));
+    zipf_distribution name_dist(first_names.size(), 1.1);
+
+    std::bernoulli_distribution active_dist(0.95);
+    std::uniform_real_distribution<double> role_dist(0, 1);
+
+    for (std::size_t i = 0; i < size; i++)
+    {
+        double r = role_dist(rng);
+        auto role = r < 0.8 ? person_data::student :
+            (r < 0.95 ? person_data::teacher : person_data::phd_student);
+        data.people.push_back(person_data{role, first_names[name_dist(rng)],
+                                          make_surname(i), active_dist(rng)});
+    }
+    std::shuffle(data.people.begin(), data.people.end(), rng);
+
+    std::size_t course_count = std::max<std::size_t>(10, size / 20);
+    for (std::size_t i = 0; i < course_count; i++)
+        data.courses.push_back(subjects[i % subjects.size()] + " " +
+                               std::to_string(i / subjects.size() + 1));
+    std::shuffle(data.courses.begin(), data.courses.end(), rng);
+
+    zipf_distribution course_dist(course_count, 0.9);
+    std::uniform_int_distribution<std::size_t> uniform_course(
+        0, course_count - 1);
+
+    for (std::size_t i = 0; i < size; i++)
+    {
+        const auto &person = data.people[i];
+        if (person.role != person_data::teacher && person.active)
+            for (int k = 0; k < 4; k++)
+                data.attends.emplace_back(i, course_dist(rng));
+        if (person.role != person_data::student)
+            for (int k = 0; k < 2; k++)
+                data.handles.emplace_back(i, uniform_course(rng));
+    }
+
+    return data;
+}
+
+template <typename F>
+void time_op(op_stats &stats, F &&f)
+{
+    auto start = bench_clock::now();
+    f();
+    stats.add(bench_clock::now() - start);
+}
+
+// Runs query up to count times, but not longer than budget.
+template <typename F>
+op_stats run_queries(const std::string &name, const options &opts,
+                     std::mt19937_64 &rng, F &&query)
+{
+    op_stats stats(name, opts.queries);
+    auto deadline = bench_clock::now() + opts.budget;
+    for (std::size_t i = 0; i < opts.queries && bench_clock::now() < deadline;
+         i++)
+        time_op(stats, [&]() { query(rng); });
+    return stats;
+}
+
+// Random fragment (of given length) of random string.
+template <typename Rng>
+std::string fragment(const std::string &str, std::size_t len, Rng &rng)
+{
+    if (str.size() <= len)
+        return str;
+    return str.substr(rng() % (str.size() - len + 1), len);
+}
+
+std::string run_size(std::size_t size, const options &opts)
+{
+    std::mt19937_64 rng(opts.seed + size);
+    std::cerr << "size " << size << ": generating data" << std::endl;
+    dataset data = generate(size, rng);
+
+    std::vector<std::string> results;
+    auto keep = [&](const auto &stats) { results.push_back(stats.to_json()); };
+
+    long rss_before = current_rss_kb();
+    College college;
+
+    std::cerr << "size " << size << ": building college" << std::endl;
+    {
+        op_stats stats("add_course", data.courses.size());
+        for (const auto &name : data.courses)
+            time_op(stats, [&]() { college.add_course(name); });
+        keep(stats);
+    }
+    {
+        op_stats stats("add_person", data.people.size());
+        for (const auto &person : data.people)
+            time_op(stats, [&]()
+            {
+                if (person.role == person_data::student)
+                    college.add_person<Student>(person.name, person.surname,
+                                                person.active);
+                else if (person.role == person_data::teacher)
+                    college.add_person<Teacher>(person.name, person.surname);
+                else
+                    college.add_person<PhDStudent>(person.name,
+                        person.surname, person.active);
+            });
+        keep(stats);
+    }
+
+    // Objects are looked up once, so assign_course is timed alone.
+    std::vector<std::shared_ptr<Course>> courses;
+    for (const auto &name : data.courses)
+        courses.push_back(*college.find_courses(name).begin());
+
+    std::vector<std::shared_ptr<Person>> people;
+    for (const auto &person : data.people)
+        people.push_back(*college.find<Person>(person.name,
+                                               person.surname).begin());
+
+    {
+        op_stats stats("assign_course", data.attends.size() +
+                                        data.handles.size());
+        for (auto [person, course] : data.attends)
+        {
+            auto student = std::dynamic_pointer_cast<Student>(people[person]);
+            time_op(stats, [&]()
+            {
+                college.assign_course<Student>(student, courses[course]);
+            });
+        }
+        for (auto [person, course] : data.handles)
+        {
+            auto teacher = std::dynamic_pointer_cast<Teacher>(people[person]);
+            time_op(stats, [&]()
+            {
+                college.assign_course<Teacher>(teacher, courses[course]);
+            });
+        }
+        keep(stats);
+    }
+
+    long build_rss = current_rss_kb() - rss_before;
+
+    std::cerr << "size " << size << ": queries" << std::endl;
+    auto random_person = [&](auto &r) -> const person_data &
+    {
+        return data.people[r() % data.people.size()];
+    };
+    auto random_course = [&](auto &r) -> const std::shared_ptr<Course> &
+    {
+        return courses[r() % courses.size()];
+    };
+
+    keep(run_queries("find_exact", opts, rng, [&](auto &r)
+    {
+        const auto &person = random_person(r);
+        college.find<Person>(person.name, person.surname);
+    }));
+    keep(run_queries("find_prefix", opts, rng, [&](auto &r)
+    {
+        college.find<Student>(random_person(r).name.substr(0, 3) + "*", "*");
+    }));
+
+    auto infix_query = [&](auto &r)
+    {
+        college.find<Person>("*", "*" + fragment(random_person(r).surname,
+                                                 3, r) + "*");
+    };
+    auto suffix_query = [&](auto &r)
+    {
+        college.find<Person>("*", "*" + surname_suffixes[r() %
+                                                  surname_suffixes.size()]);
+    };
+    keep(run_queries("find_infix", opts, rng, infix_query));
+    keep(run_queries("find_suffix", opts, rng, suffix_query));
+    keep(run_queries("find_star", opts, rng, [&](auto &)
+    {
+        college.find<Student>("*", "*");
+    }));
+
+    keep(run_queries("find_courses_exact", opts, rng, [&](auto &r)
+    {
+        college.find_courses(random_course(r)->get_name());
+    }));
+    keep(run_queries("find_courses_prefix", opts, rng, [&](auto &r)
+    {
+        college.find_courses(subjects[r() % subjects.size()].substr(0, 3) +
+                             "*");
+    }));
+    keep(run_queries("find_courses_infix", opts, rng, [&](auto &r)
+    {
+        college.find_courses("*" + fragment(random_course(r)->get_name(),
+                                            3, r) + "*");
+    }));
+
+    keep(run_queries("find_students_of_course", opts, rng, [&](auto &r)
+    {
+        college.find<Student>(random_course(r));
+    }));
+    keep(run_queries("find_teachers_of_course", opts, rng, [&](auto &r)
+    {
+        college.find<Teacher>(random_course(r));
+    }));
+
+    // The same queries through id API (no shared_ptr copies in results).
+    keep(run_queries("find_star_ids", opts, rng, [&](auto &)
+    {
+        college.find_ids<Student>("*", "*");
+    }));
+    keep(run_queries("find_students_of_course_ids", opts, rng, [&](auto &r)
+    {
+        college.find_ids<Student>(*college.get_id(random_course(r)));
+    }));
+
+    // Aggregates kept by college.
+    keep(run_queries("count_students_of_course", opts, rng, [&](auto &r)
+    {
+        college.count<Student>(random_course(r));
+    }));
+    keep(run_queries("count_active_students", opts, rng, [&](auto &)
+    {
+        college.count_active_students();
+    }));
+    keep(run_queries("top_courses_10", opts, rng, [&](auto &)
+    {
+        college.top_courses(10);
+    }));
+
+    // The same infix patterns with trigram index (and its build time).
+    {
+        op_stats stats("set_ngram_index", 1);
+        time_op(stats, [&]() { college.set_ngram_index(true); });
+        keep(stats);
+    }
+    keep(run_queries("find_infix_ngram", opts, rng, infix_query));
+    keep(run_queries("find_suffix_ngram", opts, rng, suffix_query));
+    college.set_ngram_index(false);
+
+    // Full scans split between threads (1 means parallel scans disabled).
+    // Threshold is 0, so we see the cost of parallel scans for small
+    // colleges too.
+    std::cerr << "size " << size << ": parallel scans" << std::endl;
+    for (std::size_t threads = 1; threads <= opts.threads; threads *= 2)
+    {
+        college.set_parallel_scan(threads, 0);
+
+        auto measure = [&](const std::string &name, auto &&query)
+        {
+            std::size_t ops = 0;
+            auto start = bench_clock::now();
+            auto deadline = start + opts.budget / 4;
+            for (; ops < opts.queries && bench_clock::now() < deadline; ops++)
+                query();
+            keep(throughput_stats{name, threads, ops,
+                std::chrono::duration<double>(bench_clock::now() -
+                                              start).count()});
+        };
+        measure("parallel_find_infix", [&]()
+        {
+            college.find<Person>("*a*", "*");
+        });
+        measure("parallel_find_star_ids", [&]()
+        {
+            college.find_ids<Student>("*", "*");
+        });
+        measure("parallel_find_courses_infix", [&]()
+        {
+            college.find_courses("*a*");
+        });
+    }
+    college.set_parallel_scan(1);
+
+    // Concurrent readers, alone and next to one writer changing activeness
+    // and assignments of courses.
+    std::cerr << "size " << size << ": concurrent readers" << std::endl;
+    for (std::size_t threads = 1; threads <= opts.threads; threads *= 2)
+    {
+        for (bool with_writer : {false, true})
+        {
+            std::atomic<bool> stop = false;
+            std::atomic<std::size_t> total = 0;
+            std::vector<std::thread> workers;
+
+            for (std::size_t t = 0; t < threads; t++)
+                workers.emplace_back([&, t]()
+                {
+                    std::mt19937_64 r(opts.seed * 31 + t);
+                    std::size_t ops = 0;
+                    while (!stop.load(std::memory_order_relaxed))
+                    {
+                        auto kind = r() % 10;
+                        if (kind < 5)
+                            college.find_courses(random_course(r)->get_name());
+                        else if (kind < 8)
+                            college.find<Student>(random_course(r));
+                        else
+                        {
+                            const auto &person = random_person(r);
+                            college.find<Person>(person.name, person.surname);
+                        }
+                        ops++;
+                    }
+                    total += ops;
+                });
+
+            std::thread writer;
+            if (with_writer)
+                writer = std::thread([&]()
+                {
+                    std::mt19937_64 r(opts.seed * 17);
+                    while (!stop.load(std::memory_order_relaxed))
+                    {
+                        const auto &course = random_course(r);
+                        college.change_course_activeness(course, true);
+                        auto student = std::dynamic_pointer_cast<Student>(
+                            people[r() % people.size()]);
+                        if (student != nullptr && student->is_active())
+                            college.assign_course<Student>(student, course);
+                    }
+                });
+
+            auto start = bench_clock::now();
+            std::this_thread::sleep_for(opts.budget / 4);
+            stop = true;
+            for (auto &worker : workers)
+                worker.join();
+            if (writer.joinable())
+                writer.join();
+
+            keep(throughput_stats{with_writer ? "concurrent_reads_with_writer" :
+                                                "concurrent_reads",
+                threads, total.load(), std::chrono::duration<double>(
+                    bench_clock::now() - start).count()});
+        }
+    }
+
+    // Changes synced by log of changes - one writer pays for sync of every
+    // change, more writers share syncs (group commit).
+    std::cerr << "size " << size << ": logged changes" << std::endl;
+    {
+        std::string path = (std::filesystem::temp_directory_path() /
+            ("college_benchmark_" + std::to_string(size))).string();
+        college.open_log(path);
+
+        for (std::size_t threads = 1; threads <= opts.threads; threads *= 2)
+        {
+            std::atomic<bool> stop = false;
+            std::atomic<std::size_t> total = 0;
+            std::vector<std::thread> workers;
+
+            for (std::size_t t = 0; t < threads; t++)
+                workers.emplace_back([&, t]()
+                {
+                    std::mt19937_64 r(opts.seed * 13 + t);
+                    std::size_t ops = 0;
+                    while (!stop.load(std::memory_order_relaxed))
+                    {
+                        const auto &course = random_course(r);
+                        college.change_course_activeness(course,
+                                                         !course->is_active());
+                        ops++;
+                    }
+                    total += ops;
+                });
+
+            auto start = bench_clock::now();
+            std::this_thread::sleep_for(opts.budget / 4);
+            stop = true;
+            for (auto &worker : workers)
+                worker.join();
+
+            keep(throughput_stats{"logged_change_course_activeness", threads,
+                total.load(), std::chrono::duration<double>(
+                    bench_clock::now() - start).count()});
+        }
+
+        college.close_log();
+        for (const char *suffix : {"", ".log"})
+            std::filesystem::remove(path + suffix);
+    }
+
+    {
+        std::size_t count = std::max<std::size_t>(1, courses.size() / 10);
+        op_stats stats("remove_course", count);
+        for (std::size_t i = 0; i < count; i++)
+            time_op(stats, [&]() { college.remove_course(courses[i]); });
+        keep(stats);
+    }
+    {
+        std::size_t count = std::max<std::size_t>(1, data.attends.size() / 10);
+        op_stats stats("unassign_course", count);
+        for (std::size_t i = data.attends.size() - count;
+             i < data.attends.size(); i++)
+        {
+            auto [person, course] = data.attends[i];
+            auto student = std::dynamic_pointer_cast<Student>(people[person]);
+            time_op(stats, [&]()
+            {
+                try
+                {
+                    college.unassign_course<Student>(student, courses[course]);
+                }
+                catch (const std::exception &)
+                {
+                    // Course was removed above.
+                }
+            });
+        }
+        keep(stats);
+    }
+    {
+        std::size_t count = std::max<std::size_t>(1, people.size() / 10);
+        op_stats stats("remove_person", count);
+        for (std::size_t i = 0; i < count; i++)
+            time_op(stats, [&]() { college.remove_person(people[i]); });
+        keep(stats);
+    }
+
+    std::ostringstream out;
+    out << "{\"size\": " << size << ", \"peak_rss_kb\": " << peak_rss_kb()
+        << ", \"build_rss_kb\": " << build_rss << ", \"bytes_per_entity\": "
+        << (build_rss * 1024.0 / (data.people.size() + data.courses.size()))
+        << ", \"operations\": [";
+    for (std::size_t i = 0; i < results.size(); i++)
+        out << (i > 0 ? ", " : "") << results[i];
+    out << "]}";
+    return out.str();
+}
+
+std::vector<std::size_t> parse_sizes(const std::string &list)
+{
+    std::vector<std::size_t> sizes;
+    std::istringstream in(list);
+    for (std::string item; std::getline(in, item, ',');)
+        sizes.push_back(static_cast<std::size_t>(std::stod(item)));
+    std::sort(sizes.begin(), sizes.end());
+    return sizes;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    options opts;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string flag = argv[i], value = argv[i + 1];
+        if (flag == "--sizes")
+            opts.sizes = parse_sizes(value);
+        else if (flag == "--queries")
+            opts.queries = std::stoul(value);
+        else if (flag == "--threads")
+            opts.threads = std::max(1ul, std::stoul(value));
+        else if (flag == "--seed")
+            opts.seed = std::stoull(value);
+        else if (flag == "--budget-ms")
+            opts.budget = std::chrono::milliseconds(std::stol(value));
+        else
+        {
+            std::cerr << "unknown option " << flag << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "{\"seed\": " << opts.seed << ", \"results\": [";
+    for (std::size_t i = 0; i < opts.sizes.size(); i++)
+        std::cout << (i > 0 ? ", " : "") << run_size(opts.sizes[i], opts)
+                  << std::flush;
+    std::cout << "]}" << std::endl;
+
+    return 0;
+}
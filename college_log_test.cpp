@@ -0,0 +1,279 @@
+/**
+ * Test of logged College - what is reopened from college file and its log
+ * is what college held when log was closed.
+ *
+ * Build: g++ -std=c++20 -O1 -g -fsanitize=address,undefined -pthread \
+ *            college_log_test.cpp -o college_log_test
+ * Run:   ./college_log_test [--dir /tmp]
+ *
+ * Files are made in given directory (temporary directory by default) and
+ * removed at the end. Test checks replay of log with torn last record,
+ * recovery from crash in the middle of compaction (files are arranged the
+ * way crash would leave them), trigram index kept by open_log, assigning
+ * other college to logged one, and compactions running while threads
+ * change college. It prints failed checks and exits with 1 if there were
+ * any.
+ */
+
+#include "college.h"
+
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+// Friend of College, so it can reach its private parts.
+struct CollegeTestAccess
+{
+    static bool has_ngram_index(const College &college)
+    {
+        return static_cast<bool>(college.state->ngrams);
+    }
+};
+
+namespace
+{
+
+std::size_t failures = 0;
+
+void check(bool condition, const std::string &what)
+{
+    if (!condition)
+    {
+        failures++;
+        std::cerr << "FAILED: " << what << std::endl;
+    }
+}
+
+std::filesystem::path directory;
+
+// Path of college file of given test, without files left by earlier runs.
+std::string fresh_path(const std::string &name)
+{
+    std::string path = (directory / ("college_log_test_" + name)).string();
+    for (const char *suffix : {"", ".log", ".log.next"})
+        std::filesystem::remove(path + suffix);
+    return path;
+}
+
+// Contents of college as text, so that two colleges can be compared.
+std::string dump(College &college)
+{
+    std::string out;
+    for (const auto &course : college.find_courses("*"))
+    {
+        out += course->get_name() + (course->is_active() ? "+" : "-") + ":";
+        for (const auto &student : college.find<Student>(course))
+            out += " s " + student->get_name() + " " + student->get_surname();
+        for (const auto &teacher : college.find<Teacher>(course))
+            out += " t " + teacher->get_name() + " " + teacher->get_surname();
+        out += "\n";
+    }
+    for (const auto &person : college.find<Person>("*", "*"))
+        out += person->get_name() + " " + person->get_surname() + "\n";
+    return out;
+}
+
+std::string reopened(const std::string &path)
+{
+    College college;
+    college.open_log(path);
+    std::string contents = dump(college);
+    college.close_log();
+    return contents;
+}
+
+// Some people and courses, and assignments between them.
+void fill(College &college, const std::string &prefix, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; i++)
+    {
+        std::string suffix = prefix + std::to_string(i);
+        college.add_course("Course " + suffix);
+        college.add_person<Student>("Student", suffix);
+        college.add_person<Teacher>("Teacher", suffix);
+        college.assign_course(
+            *college.find<Student>("Student", suffix).begin(),
+            *college.find_courses("Course " + suffix).begin());
+        college.assign_course(
+            *college.find<Teacher>("Teacher", suffix).begin(),
+            *college.find_courses("Course " + suffix).begin());
+    }
+}
+
+void check_torn_record()
+{
+    std::string path = fresh_path("torn");
+
+    College college;
+    college.open_log(path);
+    fill(college, "a", 10);
+    std::string expected = dump(college);
+    college.add_course("Last");
+    college.close_log();
+
+    // Crash in the middle of writing the last record.
+    std::string log_path = path + ".log";
+    std::filesystem::resize_file(log_path,
+                                 std::filesystem::file_size(log_path) - 3);
+    check(reopened(path) == expected, "torn record cut off");
+
+    // New records follow complete ones.
+    College reopened_college;
+    reopened_college.open_log(path);
+    reopened_college.add_course("After");
+    expected = dump(reopened_college);
+    reopened_college.close_log();
+    check(reopened(path) == expected, "records after torn one replayed");
+}
+
+// Crash after college file of compaction was written (or before it was),
+// but before next log was renamed to the log.
+void check_interrupted_compaction(bool file_written)
+{
+    std::string path = fresh_path("interrupted");
+    std::string log_path = path + ".log", next_path = path + ".log.next";
+
+    College college;
+    college.open_log(path);
+    fill(college, "a", 10);
+    college.close_log();
+    std::filesystem::copy_file(path, path + ".old");
+    std::filesystem::copy_file(log_path, log_path + ".old");
+
+    // Log is compacted with nothing after it, so the next one (renamed to
+    // log) gets all later records.
+    college.open_log(path);
+    college.compact_log();
+    college.close_log();
+    college.open_log(path);
+    fill(college, "b", 10);
+    std::string expected = dump(college);
+    college.close_log();
+
+    std::filesystem::rename(log_path, next_path);
+    std::filesystem::rename(log_path + ".old", log_path);
+    if (file_written)
+        std::filesystem::remove(path + ".old");
+    else
+        std::filesystem::rename(path + ".old", path);
+
+    check(reopened(path) == expected,
+          std::string("compaction interrupted ") +
+          (file_written ? "after" : "before") + " writing college file");
+    check(!std::filesystem::exists(next_path),
+          "interrupted compaction finished");
+    check(reopened(path) == expected,
+          "college reopened after finished compaction");
+}
+
+void check_ngram_index()
+{
+    std::string path = fresh_path("ngram");
+
+    College college;
+    college.open_log(path);
+    fill(college, "a", 10);
+    college.close_log();
+
+    College other;
+    other.set_ngram_index(true);
+    other.open_log(path);
+    check(CollegeTestAccess::has_ngram_index(other),
+          "trigram index enabled after opening log");
+    check(other.find_courses("*rse a1*").size() == 1,
+          "trigram index has opened contents");
+    other.close_log();
+}
+
+void check_assignment()
+{
+    std::string path = fresh_path("assignment");
+
+    College college;
+    college.open_log(path);
+    fill(college, "a", 10);
+
+    College other;
+    fill(other, "b", 10);
+    college = other;
+    fill(college, "c", 10);
+    std::string expected = dump(college);
+    college.close_log();
+
+    try
+    {
+        check(reopened(path) == expected,
+              "assigned college and later changes reopened");
+    }
+    catch (const std::exception &)
+    {
+        check(false, "log of assigned college can be reopened");
+    }
+}
+
+void check_concurrent_compaction()
+{
+    constexpr std::size_t threads = 4, rounds = 200;
+    std::string path = fresh_path("compaction");
+
+    College college;
+    College::log_options options;
+    // Small logs, so that changes keep compacting them.
+    options.compact_size = 2048;
+    college.open_log(path, options);
+
+    std::vector<std::thread> workers;
+    for (std::size_t id = 0; id < threads; id++)
+        workers.emplace_back([&college, id]()
+        {
+            fill(college, std::to_string(id) + "_", rounds);
+        });
+    for (std::size_t i = 0; i < rounds; i++)
+        college.compact_log();
+    for (auto &worker : workers)
+        worker.join();
+
+    std::string expected = dump(college);
+    college.close_log();
+    check(reopened(path) == expected, "college compacted while changed");
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    directory = std::filesystem::temp_directory_path();
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string flag = argv[i], value = argv[i + 1];
+        if (flag == "--dir")
+            directory = value;
+        else
+        {
+            std::cerr << "unknown option " << flag << std::endl;
+            return 1;
+        }
+    }
+
+    check_torn_record();
+    check_interrupted_compaction(false);
+    check_interrupted_compaction(true);
+    check_ngram_index();
+    check_assignment();
+    check_concurrent_compaction();
+
+    for (const char *name : {"torn", "interrupted", "ngram", "assignment",
+                             "compaction"})
+        fresh_path(name);
+
+    if (failures > 0)
+    {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "ok" << std::endl;
+    return 0;
+}
@@ -0,0 +1,278 @@
+/**
+ * Differential test of pattern matcher used by find and find_courses.
+ *
+ * Build (every width of vector search):
+ *   g++ -std=c++20 -O2 -DCOLLEGE_SIMD_WIDTH=0 college_matcher_test.cpp \
+ *       -o college_matcher_test_scalar
+ *   g++ -std=c++20 -O2 college_matcher_test.cpp -o college_matcher_test_sse2
+ *   g++ -std=c++20 -O2 -mavx2 college_matcher_test.cpp \
+ *       -o college_matcher_test_avx2
+ * (adding -fsanitize=address catches reads past the end of names).
+ * Run:   ./college_matcher_test [--cases 200000] [--seed 42]
+ *
+ * Random names and patterns are compared with the matcher College had before
+ * segments were searched with vector instructions (backtracking over the
+ * last *) and with a plain dynamic programming one. Names use few letters
+ * (so patterns match often) and bytes above 127, patterns have *, ?, empty
+ * segments (**) and segments of ? only. Lengths are drawn mostly around 16
+ * and 32 bytes, where vector loops hand over to the scalar one. Segment
+ * search is also compared with searching every position. Every name is kept
+ * in a buffer of its exact size, so sanitizers see reads past it. Test
+ * prints failed cases and exits with 1 if there were any.
+ */
+
+#include "college.h"
+
+#include <iostream>
+#include <random>
+
+// Friend of College, so it can reach its private parts.
+struct CollegeTestAccess
+{
+    static bool satisfies_pattern(std::string_view str,
+                                  std::string_view pattern)
+    {
+        return College::satisfies_pattern(str, pattern);
+    }
+
+    static std::size_t find_segment(std::string_view text,
+                                     std::string_view segment)
+    {
+        std::uint64_t chars = 0, backtracks = 0;
+        return College::find_segment(text, segment, chars, backtracks);
+    }
+};
+
+namespace
+{
+
+// Matcher of the first version of College.
+bool old_satisfies_pattern(const std::string &str, const std::string &pattern)
+{
+    std::size_t str_idx = 0, ptrn_idx = 0;
+    std::size_t ptrn_len = pattern.size(), str_len = str.size();
+    int last_wildcard = -1, backtrack_idx = -1, next_wildcard = -1;
+
+    while (str_idx < str_len)
+    {
+        if (ptrn_idx < ptrn_len && (pattern[ptrn_idx] == '?' ||
+                                    str[str_idx] == pattern[ptrn_idx]))
+        {
+            str_idx++;
+            ptrn_idx++;
+        }
+        else if (ptrn_idx < ptrn_len && pattern[ptrn_idx] == '*')
+        {
+            last_wildcard = ptrn_idx;
+            next_wildcard = ++ptrn_idx;
+            backtrack_idx = str_idx;
+        }
+        else if (last_wildcard == -1)
+            return false;
+        else
+        {
+            ptrn_idx = next_wildcard;
+            str_idx = ++backtrack_idx;
+        }
+    }
+
+    for (std::size_t i = ptrn_idx; i < ptrn_len; i++)
+    {
+        if (pattern[i] != '*')
+            return false;
+    }
+    return true;
+}
+
+// matches[i][j] - whether first i characters of str satisfy first j of
+// pattern.
+bool table_satisfies_pattern(std::string_view str, std::string_view pattern)
+{
+    std::vector<std::vector<bool>> matches(
+        str.size() + 1, std::vector<bool>(pattern.size() + 1, false));
+    matches[0][0] = true;
+    for (std::size_t j = 1; j <= pattern.size(); j++)
+        matches[0][j] = matches[0][j - 1] && pattern[j - 1] == '*';
+
+    for (std::size_t i = 1; i <= str.size(); i++)
+        for (std::size_t j = 1; j <= pattern.size(); j++)
+        {
+            if (pattern[j - 1] == '*')
+                matches[i][j] = matches[i][j - 1] || matches[i - 1][j];
+            else
+                matches[i][j] = matches[i - 1][j - 1] &&
+                    (pattern[j - 1] == '?' || pattern[j - 1] == str[i - 1]);
+        }
+
+    return matches[str.size()][pattern.size()];
+}
+
+std::size_t plain_find_segment(std::string_view text, std::string_view segment)
+{
+    for (std::size_t pos = 0; pos + segment.size() <= text.size(); pos++)
+    {
+        bool matches = true;
+        for (std::size_t i = 0; i < segment.size() && matches; i++)
+            matches = segment[i] == '?' || segment[i] == text[pos + i];
+        if (matches)
+            return pos;
+    }
+    return std::string_view::npos;
+}
+
+class generator
+{
+public:
+    explicit generator(std::uint64_t seed) : random(seed) {}
+
+    // Lengths near boundaries of vector blocks are the interesting ones.
+    std::size_t length()
+    {
+        static constexpr std::size_t boundaries[] = {0, 1, 15, 16, 17, 31,
+                                                     32, 33, 47, 48, 64};
+        if (pick(3) == 0)
+            return pick(70);
+        std::size_t boundary = boundaries[pick(std::size(boundaries))];
+        std::size_t delta = pick(5);
+        return delta <= 2 ? boundary + delta : boundary - std::min(
+            boundary, delta - 2);
+    }
+
+    std::string name(std::size_t size)
+    {
+        // Two bytes of 'é' in UTF-8, and a byte which isn't valid UTF-8.
+        static constexpr char letters[] = {'a', 'b', 'c', '\xc3', '\xa9',
+                                           '\xff', ' '};
+        std::string result(size, 'a');
+        std::size_t alphabet = 1 + pick(std::size(letters));
+        for (char &c : result)
+            c = letters[pick(alphabet)];
+        return result;
+    }
+
+    // Pattern made from piece of name (so it often matches) with some of its
+    // characters replaced by ?, some removed and * inserted.
+    std::string pattern(const std::string &name)
+    {
+        std::string base = pick(4) == 0 ? this->name(length()) : name;
+        std::size_t from = pick(base.size() + 1);
+        std::size_t to = from + pick(base.size() - from + 1);
+        if (pick(2) == 0)
+            from = 0;
+        if (pick(2) == 0)
+            to = base.size();
+
+        std::string result;
+        for (std::size_t i = from; i < to; i++)
+        {
+            std::size_t action = pick(12);
+            if (action == 0)
+                result += '?';
+            else if (action == 1)
+                result += '*';
+            else if (action == 2)
+                result += "**";
+            else if (action == 3)
+                continue;
+            else
+                result += base[i];
+        }
+
+        std::size_t stars = pick(4);
+        for (std::size_t i = 0; i < stars; i++)
+            result.insert(pick(result.size() + 1), 1, '*');
+        return result;
+    }
+
+    std::size_t pick(std::size_t n)
+    {
+        return n == 0 ? 0 : random() % n;
+    }
+
+private:
+    std::mt19937_64 random;
+};
+
+std::size_t failures = 0;
+
+template <typename T>
+void check(const T &actual, const T &expected, const std::string &what,
+           const std::string &text, const std::string &pattern)
+{
+    if (actual == expected)
+        return;
+
+    failures++;
+    if (failures <= 20)
+        std::cerr << "FAILED: " << what << " of \"" << text << "\" and \""
+                  << pattern << "\": " << actual << " instead of "
+                  << expected << std::endl;
+}
+
+// Copy of string in buffer of exactly its size.
+struct exact_buffer
+{
+    explicit exact_buffer(const std::string &text) :
+        data(new char[std::max<std::size_t>(text.size(), 1)]),
+        view(data.get(), text.size())
+    {
+        std::copy(text.begin(), text.end(), data.get());
+    }
+
+    std::unique_ptr<char[]> data;
+    std::string_view view;
+};
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    std::size_t cases = 200000;
+    std::uint64_t seed = 42;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string flag = argv[i], value = argv[i + 1];
+        if (flag == "--cases")
+            cases = std::stoul(value);
+        else if (flag == "--seed")
+            seed = std::stoull(value);
+        else
+        {
+            std::cerr << "unknown option " << flag << std::endl;
+            return 1;
+        }
+    }
+
+    generator generate(seed);
+    std::size_t matched = 0;
+
+    for (std::size_t i = 0; i < cases; i++)
+    {
+        std::string name = generate.name(generate.length());
+        std::string pattern = generate.pattern(name);
+        exact_buffer text(name);
+
+        bool expected = old_satisfies_pattern(name, pattern);
+        check(table_satisfies_pattern(name, pattern), expected,
+              "reference matchers", name, pattern);
+        check(CollegeTestAccess::satisfies_pattern(text.view, pattern),
+              expected, "satisfies_pattern", name, pattern);
+        matched += expected;
+
+        // Segment is a pattern without *, searched for in the name.
+        std::string segment;
+        for (char c : pattern)
+            if (c != '*')
+                segment += c;
+        exact_buffer segment_buffer(segment);
+        check(CollegeTestAccess::find_segment(text.view, segment_buffer.view),
+              plain_find_segment(name, segment), "find_segment", name,
+              segment);
+    }
+
+    std::cout << "width " << COLLEGE_SIMD_WIDTH << ": " << cases
+              << " cases, " << matched << " matched, " << failures
+              << " failed" << std::endl;
+    return failures > 0 ? 1 : 0;
+}
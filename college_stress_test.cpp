@@ -0,0 +1,459 @@
+/**
+ * Stress test of College shared between threads.
+ *
+ * Build: g++ -std=c++20 -O1 -g -fsanitize=thread -pthread \
+ *            college_stress_test.cpp -o college_stress_test
+ * Run:   ./college_stress_test [--threads 8] [--rounds 2000] [--seed 42]
+ *
+ * Threads add, assign, unassign, find and remove people and courses of one
+ * college at the same time (and take snapshots and lazy queries of it, and
+ * get cached results), so that ThreadSanitizer sees every pair of
+ * operations which may run together.
+ * At the end we check that rosters of courses and courses of people agree
+ * and that aggregates match what college holds. Test also checks that
+ * entities are spread over all shards of entity locks, and that removals
+ * through copy of college leave assignments of original alone, and that
+ * people of the same name share pooled name in our indexes while names of
+ * removed people don't stay in pool, and that lazy queries return people
+ * in the same order as find<T>. It prints failed checks and exits with 1
+ * if there were any.
+ */
+
+#include "college.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <set>
+#include <thread>
+
+// Friend of College, so it can reach its private parts.
+struct CollegeTestAccess
+{
+    static std::size_t shard_index(const void *entity)
+    {
+        return College::college_locks::shard_index(entity);
+    }
+
+    static std::size_t pooled_names(const College &college)
+    {
+        return college.name_pool.names.size();
+    }
+
+    // Number of different strings viewed by keys of people of given name.
+    static std::size_t name_strings(const College &college,
+                                    std::string_view name)
+    {
+        std::set<const char *> strings;
+        for (const auto &[key, id] : college.state->people_names)
+            if (key.first == name)
+                strings.insert(key.first.data());
+        return strings.size();
+    }
+};
+
+namespace
+{
+
+struct options
+{
+    std::size_t threads = 8;
+    std::size_t rounds = 2000;
+    std::uint64_t seed = 42;
+};
+
+std::atomic<std::size_t> failures{0};
+
+void check(bool condition, const std::string &what)
+{
+    if (!condition)
+    {
+        failures.fetch_add(1, std::memory_order_relaxed);
+        std::cerr << "FAILED: " << what << std::endl;
+    }
+}
+
+// Names of people and courses created by the worker; the first half of them
+// is created before threads start, so others have something to work on.
+std::string course_name(std::size_t worker, std::size_t i)
+{
+    return "Course " + std::to_string(worker) + "/" + std::to_string(i);
+}
+
+std::string surname(std::size_t worker, std::size_t i)
+{
+    return "Surname" + std::to_string(worker) + "_" + std::to_string(i);
+}
+
+void check_shard_spread()
+{
+    constexpr std::size_t entities = 10000, shards = 64;
+
+    College college;
+    std::vector<std::size_t> used(shards, 0);
+    for (std::size_t i = 0; i < entities; i++)
+    {
+        college.add_course(course_name(0, i));
+        college.add_person<Student>("Name", surname(0, i));
+    }
+
+    for (const auto &course : college.find_courses("*"))
+        used[CollegeTestAccess::shard_index(course.get())]++;
+    for (const auto &student : college.find<Student>("*", "*"))
+        used[CollegeTestAccess::shard_index(student.get())]++;
+
+    std::size_t least = *std::min_element(used.begin(), used.end());
+    std::size_t most = *std::max_element(used.begin(), used.end());
+    std::size_t average = 2 * entities / shards;
+    check(least > average / 2 && most < average * 2,
+          "entities spread over shards (least " + std::to_string(least) +
+          ", most " + std::to_string(most) + " of " +
+          std::to_string(2 * entities) + ")");
+}
+
+// Removals through copy of college must not change assignments of original,
+// which shares objects of people and courses with the copy.
+void check_copy_removal()
+{
+    College original;
+    original.add_course("Course");
+    original.add_person<Student>("Name", "Student");
+    original.add_person<Teacher>("Name", "Teacher");
+    auto course = *original.find_courses("Course").begin();
+    auto student = *original.find<Student>("Name", "Student").begin();
+    auto teacher = *original.find<Teacher>("Name", "Teacher").begin();
+
+    original.assign_course(student, course);
+    original.assign_course(teacher, course);
+    {
+        College copy(original);
+        copy.remove_person(student);
+        copy.remove_person(teacher);
+    }
+    check(original.count_courses(student) == 1 &&
+          original.count_courses(teacher) == 1,
+          "copy removing people keeps their courses in original");
+    check(original.unassign_course(student, course),
+          "student unassigned in original after removal from copy");
+    check(original.find<Student>(course).empty(),
+          "roster of original without unassigned student");
+
+    original.assign_course(student, course);
+    {
+        College copy(original);
+        copy.remove_course(course);
+    }
+    check(original.count<Student>(course) == 1 &&
+          original.count<Teacher>(course) == 1,
+          "copy removing course keeps its roster in original");
+
+    {
+        College copy(original);
+        copy.remove_person(student);
+        copy.remove_person(teacher);
+    }
+    original.remove_person(student);
+    check(original.find<Student>(course).empty(),
+          "roster of original without removed student");
+    original.remove_course(course);
+    check(original.count_courses(teacher) == 0,
+          "course of teacher removed with course");
+}
+
+// Keys of people of the same name view one pooled string, and names of
+// removed people are dropped from pool of names as it grows.
+void check_name_pool()
+{
+    constexpr std::size_t people = 1000;
+    College college;
+
+    college.add_person<Student>("Jan", "Kowalski");
+    college.add_person<Teacher>("Jan", "Nowak");
+    check(CollegeTestAccess::name_strings(college, "Jan") == 1,
+          "keys of people of the same name don't share pooled name");
+
+    for (std::size_t i = 0; i < people; i++)
+    {
+        std::string name = "Name" + std::to_string(i);
+        college.add_person<Student>(name, "Surname");
+        college.remove_person(*college.find<Person>(name, "Surname").begin());
+    }
+    check(CollegeTestAccess::pooled_names(college) < people / 4,
+          "pool of names keeps names of removed people (" +
+          std::to_string(CollegeTestAccess::pooled_names(college)) + ")");
+}
+
+// Lazy queries return people in the same order as find<T>, also page by
+// page, whichever index their scan uses.
+void check_query_order()
+{
+    College college;
+    const char *names[] = {"Ala", "Anna", "Bartek", "Zofia"};
+    const char *surnames[] = {"Kowalska", "Nowak", "Adamska", "Zielinska"};
+    for (const char *name : names)
+        for (const char *surname : surnames)
+            college.add_person<Student>(name, surname);
+    college.add_person<Teacher>("Anna", "Baran");
+
+    const std::pair<const char *, const char *> patterns[] = {
+        {"*", "*"}, {"A*", "*"}, {"Anna", "*"}, {"Anna", "N*"},
+        {"*", "Z*"}, {"*nna", "*"}, {"*", "*ska"}, {"?a*", "*a"}};
+
+    for (bool ngrams : {false, true})
+    {
+        college.set_ngram_index(ngrams);
+        for (const auto &[name, surname] : patterns)
+        {
+            auto found = college.find<Student>(name, surname);
+            std::vector<std::shared_ptr<Student>> expected(found.begin(),
+                                                           found.end());
+            auto query = college.query<Student>(name, surname);
+            std::vector<std::shared_ptr<Student>> lazy;
+            for (const auto &student : query)
+                lazy.push_back(student);
+
+            std::vector<std::shared_ptr<Student>> paged;
+            auto page = query.page(3);
+            for (;; page = query.page(3, page.next))
+            {
+                paged.insert(paged.end(), page.items.begin(),
+                             page.items.end());
+                if (!page.next.has_value())
+                    break;
+            }
+
+            std::string what = std::string(" of query ") + name + " " +
+                surname + (ngrams ? " with" : " without") + " trigrams";
+            check(lazy == expected, "order" + what);
+            check(paged == expected, "pages" + what);
+            check(query.count() == expected.size(), "count" + what);
+        }
+    }
+}
+
+// Assignments meet inactive and removed people and courses, College throws
+// then, which is expected here.
+template <typename F>
+void expecting_errors(F f)
+{
+    try
+    {
+        f();
+    }
+    catch (const std::exception &)
+    {
+    }
+}
+
+void worker(College &college, std::size_t id, const options &opts)
+{
+    std::mt19937_64 random(opts.seed + id);
+    auto pick = [&](std::size_t n) { return random() % n; };
+
+    std::size_t created = opts.rounds / 2;
+    for (std::size_t round = 0; round < opts.rounds; round++)
+    {
+        // Other workers' entities are touched as well, so shards and
+        // rosters are contended.
+        std::size_t other = pick(opts.threads);
+        std::size_t i = pick(created);
+
+        switch (pick(12))
+        {
+        case 0:
+            college.add_course(course_name(id, created));
+            college.add_person<Student>("Name", surname(id, created));
+            created++;
+            break;
+        case 1:
+        case 2:
+        {
+            auto courses = college.find_courses(course_name(other, i));
+            auto students = college.find<Student>("Name", surname(other, i));
+            for (const auto &course : courses)
+                for (const auto &student : students)
+                    expecting_errors([&]
+                    {
+                        college.assign_course(student, course);
+                    });
+            break;
+        }
+        case 3:
+        {
+            auto courses = college.find_courses(course_name(other, i));
+            auto teachers = college.find<Teacher>("*", surname(other, i));
+            for (const auto &course : courses)
+                for (const auto &teacher : teachers)
+                    expecting_errors([&]
+                    {
+                        college.assign_course(teacher, course);
+                    });
+            break;
+        }
+        case 4:
+        {
+            auto courses = college.find_courses(course_name(other, i));
+            auto students = college.find<Student>("Name", surname(other, i));
+            for (const auto &course : courses)
+                for (const auto &student : students)
+                    expecting_errors([&]
+                    {
+                        college.unassign_course(student, course);
+                    });
+            break;
+        }
+        case 5:
+            for (const auto &course : college.find_courses(
+                     course_name(other, i)))
+            {
+                college.find<Student>(course);
+                college.find<Teacher>(course);
+                college.count<Student>(course);
+                college.change_course_activeness(course, !course->is_active());
+            }
+            break;
+        case 6:
+            college.find<Student>("Na*", "Surname" + std::to_string(other) +
+                                  "_1*");
+            college.find_courses("Course " + std::to_string(other) + "/?");
+            college.count_active_students();
+            college.top_courses(3);
+            break;
+        case 7:
+            for (const auto &student : college.find<Student>(
+                     "Name", surname(other, i)))
+            {
+                college.count_courses(student);
+                college.get_courses(student);
+                college.change_student_activeness(student,
+                                                  !student->is_active());
+            }
+            break;
+        case 8:
+        {
+            auto snapshot = college.snapshot();
+            snapshot.find_courses("Course " + std::to_string(other) + "/*");
+            snapshot.find<Person>("*", surname(other, i));
+            snapshot.top_courses(3);
+            auto query = college.query<Student>("*", "Surname" +
+                                                std::to_string(other) + "*");
+            query.first_n(5);
+            break;
+        }
+        case 9:
+            for (const auto &person : college.find<Person>(
+                     "*", surname(id, pick(created))))
+                college.remove_person(person);
+            break;
+        case 10:
+            for (const auto &course : college.find_courses(
+                     course_name(id, pick(created))))
+                college.remove_course(course);
+            break;
+        default:
+            college.find_ids<Person>("*", surname(other, i));
+            for (auto course : college.find_course_ids(course_name(other, i)))
+            {
+                college.find_ids<Student>(course);
+                for (auto person : college.find_ids<Teacher>("*",
+                                                     surname(other, i)))
+                    expecting_errors([&]
+                    {
+                        college.assign_course<Teacher>(person, course);
+                    });
+            }
+            break;
+        }
+    }
+}
+
+void check_consistency(College &college)
+{
+    std::size_t active_students = 0, active_courses = 0;
+
+    for (const auto &course : college.find_courses("*"))
+    {
+        active_courses += course->is_active();
+        for (const auto &person : college.find<Student>(course))
+            check(std::dynamic_pointer_cast<Student>(person)->get_courses()
+                      .contains(course),
+                  "student of " + course->get_name() + " attends it");
+    }
+
+    for (const auto &student : college.find<Student>("*", "*"))
+    {
+        active_students += student->is_active();
+        check(college.count_courses(student) == student->get_courses().size(),
+              "count of courses of " + student->get_surname());
+        check(college.get_courses(student) == student->get_courses(),
+              "copy of courses of " + student->get_surname());
+        for (const auto &course : student->get_courses())
+            check(!college.find_courses(course->get_name()).empty(),
+                  "course of " + student->get_surname() + " is in college");
+    }
+
+    check(college.count_active_students() == active_students,
+          "count of active students");
+    check(college.count_active_courses() == active_courses,
+          "count of active courses");
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    options opts;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string flag = argv[i], value = argv[i + 1];
+        if (flag == "--threads")
+            opts.threads = std::max(1ul, std::stoul(value));
+        else if (flag == "--rounds")
+            opts.rounds = std::max(2ul, std::stoul(value));
+        else if (flag == "--seed")
+            opts.seed = std::stoull(value);
+        else
+        {
+            std::cerr << "unknown option " << flag << std::endl;
+            return 1;
+        }
+    }
+
+    check_shard_spread();
+    check_copy_removal();
+    check_name_pool();
+    check_query_order();
+
+    College college;
+    college.set_parallel_scan(2, 64);
+    college.set_query_cache(64);
+    for (std::size_t id = 0; id < opts.threads; id++)
+        for (std::size_t i = 0; i < opts.rounds / 2; i++)
+        {
+            college.add_course(course_name(id, i));
+            if (i % 5 == 0)
+                college.add_person<Teacher>("Teacher", surname(id, i));
+            else if (i % 5 == 1)
+                college.add_person<PhDStudent>("Name", surname(id, i));
+            else
+                college.add_person<Student>("Name", surname(id, i));
+        }
+
+    std::vector<std::thread> threads;
+    for (std::size_t id = 0; id < opts.threads; id++)
+        threads.emplace_back(worker, std::ref(college), id, std::cref(opts));
+    for (auto &thread : threads)
+        thread.join();
+
+    check_consistency(college);
+
+    if (failures.load() > 0)
+    {
+        std::cerr << failures.load() << " checks failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "ok" << std::endl;
+    return 0;
+}